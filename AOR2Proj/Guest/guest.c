@@ -8,6 +8,18 @@ static void outb(uint16_t port, uint8_t value) {
 static void inb(uint16_t port,uint8_t *dest){
     asm("inb %1,%0":"=a"(*dest):"d"(port));
 }
+// rep outsb, host dobija vise bajtova po izlasku (KVM moze da podeli niz na vise izlazaka)
+static void outsb(uint16_t port, const void *buf, size_t len) {
+    asm volatile("rep outsb" : "+S" (buf), "+c" (len) : "d" (port) : "memory");
+}
+static void insb(uint16_t port, void *buf, size_t len) {
+    asm volatile("rep insb" : "+D" (buf), "+c" (len) : "d" (port) : "memory");
+}
+static size_t str_len(const char *s) {
+    size_t n = 0;
+    while (s[n]) n++;
+    return n;
+}
 void
 __attribute__((noreturn))
 __attribute__((section(".start")))
@@ -20,13 +32,13 @@ _start(void) {
     const char *p;
     uint16_t port = 0xE9;
     //uint8_t value = 'E';
-    inb(0xE9,&input[0]);
+    insb(0xE9,input,1);
     input[1] = '\0';
     outb(0xE9,input[0]);
     outb(0xE9,input[1]);
     //asm("outb %0,%1" : /* empty */ : "a" (value), "Nd" (port) : "memory");
-    for (p = "Hello, world!\n"; *p; ++p)
-        outb(port, *p);
+    p = "Hello, world!\n";
+    outsb(port, p, str_len(p));
 
 
 
@@ -1,14 +1,53 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#define CONSOLE_RING_PORT 0xEA
+#define CONSOLE_RING_SIZE 1024
+
+/*
+ * Konzolni ring koji cita hipervizor, raspored mora da se poklapa sa
+ * struct console_ring u mini_hypervisor.c
+ */
+struct console_ring {
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    uint32_t size;
+    uint32_t reserved;
+    char data[CONSOLE_RING_SIZE];
+};
+
+static struct console_ring console;
+
 static void outb(uint16_t port, uint8_t value) {
     asm("outb %0,%1" : /* empty */ : "a" (value), "Nd" (port) : "memory");
 }
 
+static void outl(uint16_t port, uint32_t value) {
+    asm("outl %0,%1" : /* empty */ : "a" (value), "Nd" (port) : "memory");
+}
+
 static void inb(uint16_t port,uint8_t *dest){
     asm("inb %1,%0":"=a"(*dest):"d"(port));
 }
 
+// jedan izlazak iz gosta za sve sto je do sada upisano u ring
+static void console_flush(void) {
+    if (console.head != console.tail)
+        outl(CONSOLE_RING_PORT, (uint32_t)(uintptr_t)&console);
+}
+
+static void console_putc(char c) {
+    if (console.head - console.tail == CONSOLE_RING_SIZE)
+        console_flush();
+    console.data[console.head % CONSOLE_RING_SIZE] = c;
+    console.head++;
+}
+
+static void console_puts(const char *s) {
+    for (; *s; ++s)
+        console_putc(*s);
+}
+
 void
 __attribute__((noreturn))
 __attribute__((section(".start")))
@@ -24,10 +63,11 @@ _start(void) {
     uint8_t input;
     //inb(0xE9,&input);
     //outb(0xE9,input);
+    console.size = CONSOLE_RING_SIZE;
     for (int i=0;i<20;i++){
-        for (p = "Ovo je kod Guest1!\n"; *p; ++p)
-            outb(0xE9, *p);
+        console_puts("Ovo je kod Guest1!\n");
     }
+    console_flush();
 
 
 
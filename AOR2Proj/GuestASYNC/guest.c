@@ -0,0 +1,191 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#define IO_KICK_PORT 0x279
+#define IO_QUEUE_PORT 0x27A
+
+#define QUEUE_SIZE 16
+#define CONSOLE_RING_SIZE 1024
+
+#define FILE_OP_OPEN 1
+#define FILE_OP_CLOSE 2
+#define FILE_OP_READ 3
+#define FILE_OP_WRITE 4
+
+#define FILE_REQ_PENDING 1
+#define FILE_REQ_DONE 2
+
+/*
+ * Strukture moraju da se poklapaju sa mini_hypervisor.c
+ */
+struct file_request {
+    uint32_t opcode;
+    int32_t handle;
+    uint64_t addr;
+    uint64_t len;
+    uint64_t offset;
+    char mode[4];
+    uint32_t status;
+    int64_t result;
+};
+
+struct io_queue {
+    uint32_t head;
+    uint32_t tail;
+    uint32_t size;
+    uint32_t reserved;
+    uint64_t console_ring;
+    uint64_t requests[QUEUE_SIZE];
+};
+
+struct console_ring {
+    uint32_t head;
+    uint32_t tail;
+    uint32_t size;
+    uint32_t reserved;
+    char data[CONSOLE_RING_SIZE];
+};
+
+static struct io_queue queue;
+static struct console_ring console;
+static struct file_request reqs[QUEUE_SIZE];
+
+static void outb(uint16_t port, uint8_t value) {
+    asm("outb %0,%1" : /* empty */ : "a" (value), "Nd" (port) : "memory");
+}
+
+static void outl(uint16_t port, uint32_t value) {
+    asm("outl %0,%1" : /* empty */ : "a" (value), "Nd" (port) : "memory");
+}
+
+static size_t str_len(const char *s) {
+    size_t n = 0;
+    while (s[n]) n++;
+    return n;
+}
+
+// ne izlazi iz gosta, host samo dobija signal na eventfd
+static void kick(void) {
+    outb(IO_KICK_PORT, 0);
+}
+
+static void console_putc(char c) {
+    if (console.head - __atomic_load_n(&console.tail, __ATOMIC_ACQUIRE) == CONSOLE_RING_SIZE) {
+        kick();
+        while (console.head - __atomic_load_n(&console.tail, __ATOMIC_ACQUIRE) == CONSOLE_RING_SIZE)
+            asm("pause");
+    }
+    console.data[console.head % CONSOLE_RING_SIZE] = c;
+    __atomic_store_n(&console.head, console.head + 1, __ATOMIC_RELEASE);
+}
+
+static void console_puts(const char *s) {
+    for (; *s; ++s)
+        console_putc(*s);
+}
+
+static void console_putnum(uint64_t n) {
+    char buf[21];
+    int i = 20;
+    buf[i] = '\0';
+    do {
+        buf[--i] = '0' + n % 10;
+        n /= 10;
+    } while (n);
+    console_puts(&buf[i]);
+}
+
+static void submit(struct file_request *req) {
+    while (queue.head - __atomic_load_n(&queue.tail, __ATOMIC_ACQUIRE) == QUEUE_SIZE)
+        asm("pause");
+    req->status = FILE_REQ_PENDING;
+    queue.requests[queue.head % QUEUE_SIZE] = (uint64_t)(uintptr_t)req;
+    __atomic_store_n(&queue.head, queue.head + 1, __ATOMIC_RELEASE);
+    kick();
+}
+
+static int64_t wait(struct file_request *req) {
+    while (__atomic_load_n(&req->status, __ATOMIC_ACQUIRE) != FILE_REQ_DONE)
+        asm("pause");
+    return req->result;
+}
+
+static void prepare(struct file_request *req, uint32_t opcode, int32_t handle,
+                    const void *buf, uint64_t len, uint64_t offset) {
+    req->opcode = opcode;
+    req->handle = handle;
+    req->addr = (uint64_t)(uintptr_t)buf;
+    req->len = len;
+    req->offset = offset;
+}
+
+void
+__attribute__((noreturn))
+__attribute__((section(".start")))
+_start(void) {
+
+    /*
+        INSERT CODE BELOW THIS LINE
+    */
+
+    static char buffer[512];
+    char *file_name = "async.txt";
+    char *line = "Asinhroni upis iz gosta\n";
+    size_t line_len = str_len(line);
+
+    console.size = CONSOLE_RING_SIZE;
+    queue.size = QUEUE_SIZE;
+    queue.console_ring = (uint64_t)(uintptr_t)&console;
+    outl(IO_QUEUE_PORT, (uint32_t)(uintptr_t)&queue);
+
+    reqs[0].mode[0] = 'w';
+    reqs[0].mode[1] = '+';
+    reqs[0].mode[2] = '\0';
+    prepare(&reqs[0], FILE_OP_OPEN, -1, file_name, str_len(file_name), 0);
+    submit(&reqs[0]);
+    int fd = wait(&reqs[0]);
+    if (fd < 0) {
+        console_puts("open failed\n");
+        kick();
+        for (;;)
+            asm("hlt");
+    }
+
+    // upisi idu u pozadini dok gost racuna
+    for (int i = 1; i <= 8; i++) {
+        prepare(&reqs[i], FILE_OP_WRITE, fd, line, line_len, (i - 1) * line_len);
+        submit(&reqs[i]);
+    }
+
+    uint64_t primes = 0;
+    for (uint64_t n = 2; n < 20000; n++) {
+        uint64_t d = 2;
+        while (d * d <= n && n % d) d++;
+        if (d * d > n) primes++;
+    }
+
+    for (int i = 1; i <= 8; i++)
+        wait(&reqs[i]);
+
+    prepare(&reqs[9], FILE_OP_READ, fd, buffer, sizeof(buffer) - 1, 0);
+    submit(&reqs[9]);
+    int64_t n = wait(&reqs[9]);
+    if (n > 0) {
+        buffer[n] = '\0';
+        console_puts(buffer);
+    }
+    console_puts("primes below 20000: ");
+    console_putnum(primes);
+    console_putc('\n');
+
+    prepare(&reqs[10], FILE_OP_CLOSE, fd, NULL, 0, 0);
+    submit(&reqs[10]);
+    wait(&reqs[10]);
+
+    /*
+        INSERT CODE ABOVE THIS LINE
+    */
+
+    for (;;)
+        asm("hlt");
+}
@@ -11,78 +11,72 @@ static void inb(uint16_t port,uint8_t *dest){
     asm("inb %1,%0":"=a"(*dest):"d"(port));
 }
 
-static void f_open(char* file_name,char* rw){
-    int port = 0x278;
-
-    outb(port,0x01);//signal za open
-    for (char* p = file_name;*p!='\0';p++){
-        outb(port,*p);
-    }
-    outb(port,'\0');
-
-    for (char* p = rw;*p!='\0';p++){
-        outb(port,*p);
-    }
-    outb(port,'\0');
-    uint8_t ret;
-    inb(port,&ret);
-
-    if (ret != 0){
-        for (;;)
-            asm("hlt");
-    }
+// rep outsb, host dobija vise bajtova po izlasku (KVM moze da podeli niz na vise izlazaka)
+static void outsb(uint16_t port, const void *buf, size_t len) {
+    asm volatile("rep outsb" : "+S" (buf), "+c" (len) : "d" (port) : "memory");
 }
-static void f_write(char* file_name, char* line){
-    int port = 0x278;
-
-    outb(port,0x04);//signal za write
-    for (char* p = file_name;*p!='\0';p++){
-        outb(port,*p);
-    }
-    outb(port,'\0');
 
-    for (char* p = line;*p!='\0';p++){
-        outb(port,*p);
-    }
-    outb(port,'\0');
+static void outl(uint16_t port, uint32_t value) {
+    asm("outl %0,%1" : /* empty */ : "a" (value), "Nd" (port) : "memory");
 }
 
-static void f_close(char* file_name){
-    int port = 0x278;
-
-    outb(port,0x02);//signal za close
-    for (char* p = file_name;*p!='\0';p++){
-        outb(port,*p);
-    }
-    outb(port,'\0');
+static size_t str_len(const char *s) {
+    size_t n = 0;
+    while (s[n]) n++;
+    return n;
 }
-static char* f_read(char* buffer,char* file_name,char* size){
-
-
-    int port = 0x278;
-    outb(port,0x03);//signal za read
-    for (char* p = file_name;*p!='\0';p++){
-        outb(port,*p);
-    }
-    outb(port,'\0');
-
-
-
-    for (char* p = size;*p!='\0';p++){
-        outb(port,*p);
-    }
-    outb(port,'\0');
 
+#define FILE_OP_OPEN 1
+#define FILE_OP_CLOSE 2
+#define FILE_OP_READ 3
+#define FILE_OP_WRITE 4
+
+/*
+ * Zahtev za hipervizor, raspored mora da se poklapa sa
+ * struct file_request u mini_hypervisor.c
+ */
+struct file_request {
+    uint32_t opcode;
+    int32_t handle;
+    uint64_t addr;
+    uint64_t len;
+    uint64_t offset;
+    char mode[4];
+    uint32_t reserved;
+    int64_t result;
+};
+
+static struct file_request req;
+
+// ceo zahtev je jedan izlazak iz gosta, host upisuje rezultat u req.result
+static int64_t file_call(uint32_t opcode, int32_t handle, const void *buf, uint64_t len, uint64_t offset){
+    req.opcode = opcode;
+    req.handle = handle;
+    req.addr = (uint64_t)(uintptr_t)buf;
+    req.len = len;
+    req.offset = offset;
+    outl(0x278, (uint32_t)(uintptr_t)&req);
+    return req.result;
+}
 
-    int i=0;
-    while(true){
-        inb(port,&buffer[i]);
-        if (buffer[i] == '\0') break;
-        i++;
+static int f_open(char* file_name,char* rw){
+    for (int i = 0; i < 4; i++){
+        req.mode[i] = rw[i];
+        if (rw[i] == '\0') break;
     }
+    return file_call(FILE_OP_OPEN, -1, file_name, str_len(file_name), 0);
+}
 
+static int64_t f_write(int fd, const char* buf, uint64_t len, uint64_t offset){
+    return file_call(FILE_OP_WRITE, fd, buf, len, offset);
+}
 
+static int64_t f_read(int fd, char* buf, uint64_t len, uint64_t offset){
+    return file_call(FILE_OP_READ, fd, buf, len, offset);
+}
 
+static void f_close(int fd){
+    file_call(FILE_OP_CLOSE, fd, NULL, 0, 0);
 }
 
 void
@@ -99,19 +93,22 @@ _start(void) {
     uint8_t value = 'E';
     uint8_t input;
     char* file_name = "test.txt";
-    f_open(file_name,"r+");
-    char buffer[255];
+    static char buffer[255];
 
-    f_write(file_name,"Ovo je test upisa u fajl\n");
+    int fd = f_open(file_name,"r+");
+    if (fd < 0){
+        for (;;)
+            asm("hlt");
+    }
 
-    char* temp = buffer;
-    f_read(temp,file_name,"100");
+    char* line = "Ovo je test upisa u fajl\n";
+    f_write(fd,line,str_len(line),0);
 
-    for (char* p = temp;*p!='\0';p++){
-        outb(0xE9,*p);
-    }
+    int64_t n = f_read(fd,buffer,100,0);
+    if (n > 0)
+        outsb(0xE9,buffer,n);
 
-    f_close(file_name);
+    f_close(fd);
     /*
         INSERT CODE ABOVE THIS LINE
     */
@@ -0,0 +1,166 @@
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Registri MMIO prozora, moraju da se poklapaju sa mini_hypervisor.c
+ */
+#define MMIO_BASE 0xC00000000ULL
+#define MMIO_CONSOLE_DATA 0x00
+#define MMIO_CONSOLE_RING 0x08
+#define MMIO_CONSOLE_IN 0x10
+#define MMIO_FILE_REQUEST 0x18
+#define MMIO_TIME_NS 0x20
+#define MMIO_FREE_PAGES 0x30
+
+#define CONSOLE_RING_SIZE 1024
+
+#define FILE_OP_OPEN 1
+#define FILE_OP_CLOSE 2
+#define FILE_OP_READ 3
+#define FILE_OP_WRITE 4
+
+struct console_ring {
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    uint32_t size;
+    uint32_t reserved;
+    char data[CONSOLE_RING_SIZE];
+};
+
+struct file_request {
+    uint32_t opcode;
+    int32_t handle;
+    uint64_t addr;
+    uint64_t len;
+    uint64_t offset;
+    char mode[4];
+    uint32_t reserved;
+    int64_t result;
+};
+
+struct free_page_report {
+    uint32_t count;
+    uint32_t reserved;
+    uint64_t reclaimed;
+    struct {
+        uint64_t addr;
+        uint64_t len;
+    } ranges[1];
+};
+
+// radni prostor koji gost koristi pa vraca hostu, ispod steka
+#define SCRATCH_ADDR 0x100000
+#define SCRATCH_SIZE 0x80000
+
+static struct console_ring console;
+static struct file_request req;
+static struct free_page_report report;
+
+// "memory" sprecava kompajler da pomeri upise u req/report preko zvona ili citanje rezultata pre njega
+static void mmio_write(uint64_t reg, uint64_t value) {
+    asm volatile("movq %0,(%1)" : /* empty */ : "r" (value), "r" (MMIO_BASE + reg) : "memory");
+}
+
+static uint64_t mmio_read(uint64_t reg) {
+    uint64_t value;
+    asm volatile("movq (%1),%0" : "=r" (value) : "r" (MMIO_BASE + reg) : "memory");
+    return value;
+}
+
+static size_t str_len(const char *s) {
+    size_t n = 0;
+    while (s[n]) n++;
+    return n;
+}
+
+static void console_flush(void) {
+    if (console.head != console.tail)
+        mmio_write(MMIO_CONSOLE_RING, (uint64_t)(uintptr_t)&console);
+}
+
+static void console_putc(char c) {
+    if (console.head - console.tail == CONSOLE_RING_SIZE)
+        console_flush();
+    console.data[console.head % CONSOLE_RING_SIZE] = c;
+    console.head++;
+}
+
+static void console_puts(const char *s) {
+    for (; *s; ++s)
+        console_putc(*s);
+}
+
+static void console_putnum(uint64_t n) {
+    char buf[21];
+    int i = 20;
+    buf[i] = '\0';
+    do {
+        buf[--i] = '0' + n % 10;
+        n /= 10;
+    } while (n);
+    console_puts(&buf[i]);
+}
+
+static int64_t file_call(uint32_t opcode, int32_t handle, const void *buf, uint64_t len, uint64_t offset){
+    req.opcode = opcode;
+    req.handle = handle;
+    req.addr = (uint64_t)(uintptr_t)buf;
+    req.len = len;
+    req.offset = offset;
+    mmio_write(MMIO_FILE_REQUEST, (uint64_t)(uintptr_t)&req);
+    return req.result;
+}
+
+void
+__attribute__((noreturn))
+__attribute__((section(".start")))
+_start(void) {
+
+    /*
+        INSERT CODE BELOW THIS LINE
+    */
+
+    static char buffer[256];
+    char* file_name = "test.txt";
+
+    console.size = CONSOLE_RING_SIZE;
+    uint64_t start = mmio_read(MMIO_TIME_NS);
+
+    req.mode[0] = 'r';
+    req.mode[1] = '\0';
+    int fd = file_call(FILE_OP_OPEN, -1, file_name, str_len(file_name), 0);
+    if (fd >= 0) {
+        int64_t n = file_call(FILE_OP_READ, fd, buffer, sizeof(buffer) - 1, 0);
+        if (n > 0) {
+            buffer[n] = '\0';
+            console_puts("test.txt: ");
+            console_puts(buffer);
+            console_putc('\n');
+        }
+        file_call(FILE_OP_CLOSE, fd, NULL, 0, 0);
+    }
+
+    console_puts("MMIO guest done in ");
+    console_putnum(mmio_read(MMIO_TIME_NS) - start);
+    console_puts(" ns\n");
+
+    // koristimo radni prostor, a zatim ga javljamo kao slobodan
+    volatile uint8_t *scratch = (volatile uint8_t *)SCRATCH_ADDR;
+    for (uint64_t i = 0; i < SCRATCH_SIZE; i += 4096)
+        scratch[i] = 1;
+    report.count = 1;
+    report.ranges[0].addr = SCRATCH_ADDR;
+    report.ranges[0].len = SCRATCH_SIZE;
+    mmio_write(MMIO_FREE_PAGES, (uint64_t)(uintptr_t)&report);
+    console_puts("returned ");
+    console_putnum(report.reclaimed >> 10);
+    console_puts(" KB to the host\n");
+    console_flush();
+
+    /*
+        INSERT CODE ABOVE THIS LINE
+    */
+
+    for (;;)
+        asm("hlt");
+}
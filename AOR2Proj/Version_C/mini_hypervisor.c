@@ -1,4 +1,3 @@
-#include <stdio.h>
 #define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,9 +12,22 @@
 #include <stdbool.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <linux/io_uring.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdarg.h>
 #define PDE64_PRESENT 1
 #define PDE64_RW (1U << 1)
 #define PDE64_USER (1U << 2)
+#define PDE64_ACCESSED (1U << 5)
+#define PDE64_DIRTY (1U << 6)
 #define PDE64_PS (1U << 7)
 
 // CR4
@@ -28,34 +40,645 @@
 #define EFER_LME (1U << 8)
 #define EFER_LMA (1U << 10)
 
+// Portovi
+#define CONSOLE_PORT 0xE9
+#define CONSOLE_RING_PORT 0xEA
+#define FILE_PORT 0x278
+#define IO_KICK_PORT 0x279 // doorbell za asinhroni red (ioeventfd, bez izlaska)
+#define IO_QUEUE_PORT 0x27A // registracija asinhronog reda, podatak je adresa
+
+// Komande opisnog (descriptor) protokola za fajlove
+#define FILE_OP_OPEN 1
+#define FILE_OP_CLOSE 2
+#define FILE_OP_READ 3
+#define FILE_OP_WRITE 4
+
+/*
+ * MMIO prozor sa registrima za usluge hosta. Nalazi se van RAM-a gosta
+ * (nema memorijskog slota), pa svaki pristup izaziva KVM_EXIT_MMIO.
+ * Svi registri su 8 bajtova, upis adrese/duzine je jedan pristup.
+ */
+#define MMIO_BASE 0xC00000000ULL
+#define MMIO_SIZE 0x1000
+#define MMIO_CONSOLE_DATA 0x00 // upis: ispis 1-8 bajtova
+#define MMIO_CONSOLE_RING 0x08 // upis: adresa konzolnog ringa
+#define MMIO_CONSOLE_IN 0x10 // citanje: broj sa ulaza
+#define MMIO_FILE_REQUEST 0x18 // upis: adresa struct file_request
+#define MMIO_TIME_NS 0x20 // citanje: CLOCK_MONOTONIC u ns
+#define MMIO_SNAPSHOT 0x28 // upis: trazi snimak stanja (--snapshot-at hypercall)
+#define MMIO_FREE_PAGES 0x30 // upis: adresa struct free_page_report
+#define MMIO_CPU_ID 0x38 // citanje: indeks vCPU-a koji cita
+#define MMIO_NUM_CPUS 0x40 // citanje: broj vCPU-a gosta
+
+#define MAX_VCPUS 32
+#define VCPU_STACK_SIZE 0x10000 // vCPU i pocinje sa rsp = mem_size - i * VCPU_STACK_SIZE
+
+// Virtuelni procesor, svaki ima svoj fd i svoje kvm_run mapiranje.
+struct vcpu {
+    int fd;
+    struct kvm_run *run;
+};
+
 struct vm {
-    int kvm_fd;
     int vm_fd;
-    int vcpu_fd;
+    int id;
     char *mem;
-    struct kvm_run *kvm_run;
+    size_t mem_size;
+    struct vcpu vcpus[MAX_VCPUS];
+    int num_vcpus;
+    // konzolni ring i coalesced prsten su zajednicki za sve vCPU-e
+    pthread_mutex_t console_lock;
+    // upisi na konzolu koje KVM skuplja bez izlaska iz gosta (NULL ako nije ukljuceno)
+    struct kvm_coalesced_mmio_ring *coalesced;
+    uint32_t coalesced_max;
+    bool snapshot_requested; // gost je upisao u MMIO_SNAPSHOT
+    uint64_t reclaimed_bytes; // vraceno hostu preko MMIO_FREE_PAGES
+    uint64_t free_reports;
+    void *pt_tables; // mapiranje sablona tabela stranica (slot PT_SLOT)
+    size_t pt_size;
+    bool mem_huge; // memorija je iz alloc_huge_mem
+    size_t mem_page; // stvarna stranica hosta iza memorije (4KB, 2MB THP ili hugetlb)
+    size_t file_mapped; // pocetak memorije mapiran iz fajla (slika ili snimak)
+};
+
+/*
+ * Konzolni ring bafer u memoriji gosta.
+ * Gost upisuje karaktere na data[head % size] i pomera head, a kada se bafer
+ * napuni (ili kada gost zeli flush) salje adresu ringa jednim 32-bitnim OUT-om
+ * na CONSOLE_RING_PORT. Host tada ispisuje sve od tail do head i pomera tail.
+ */
+struct console_ring {
+    uint32_t head;
+    uint32_t tail;
+    uint32_t size;
+    uint32_t reserved;
+    char data[];
+};
+
+/*
+ * Zahtev za rad sa fajlom koji gost pravi u svojoj memoriji.
+ * Gost salje adresu zahteva jednim 32-bitnim OUT-om na FILE_PORT, host radi
+ * pread/pwrite direktno nad memorijom gosta i upisuje rezultat u result:
+ * handle za open, broj prenetih bajtova za read/write, -errno za gresku.
+ * Kada je rezultat upisan, status postaje FILE_REQ_DONE.
+ */
+struct file_request {
+    uint32_t opcode;
+    int32_t handle;
+    uint64_t addr; // adresa bafera u memoriji gosta (ime fajla za open)
+    uint64_t len;
+    uint64_t offset;
+    char mode[4]; // samo za open
+    uint32_t status;
+    int64_t result;
+};
+
+#define FILE_REQ_PENDING 1
+#define FILE_REQ_DONE 2
+
+/*
+ * Gost javlja opsege fizicke memorije koje ne koristi (balon). Host ih
+ * odbacuje sa madvise, pa gost pri sledecem pristupu dobija stranicu sa
+ * nulama (ili sadrzaj slike, za pocetak memorije). Koriste se samo cele
+ * stranice hosta unutar opsega, a u reclaimed host upisuje broj vracenih bajtova.
+ */
+struct free_range {
+    uint64_t addr;
+    uint64_t len;
 };
 
-int init_vm(struct vm *vm, size_t mem_size)
+struct free_page_report {
+    uint32_t count;
+    uint32_t reserved;
+    uint64_t reclaimed;
+    struct free_range ranges[];
+};
+
+/*
+ * Asinhroni red zahteva u memoriji gosta. Gost ga registruje jednom
+ * (OUT adrese na IO_QUEUE_PORT), zatim upisuje adrese zahteva u requests,
+ * pomera head i javlja se sa outb na IO_KICK_PORT. Taj port je vezan za
+ * ioeventfd, pa KVM samo signalizira eventfd i gost nastavlja da radi dok
+ * I/O nit hosta obradjuje zahteve i postavlja status na FILE_REQ_DONE.
+ * Ako je console_ring razlicit od 0, ista nit prazni i konzolni ring.
+ */
+struct io_queue {
+    uint32_t head; // gost
+    uint32_t tail; // host
+    uint32_t size;
+    uint32_t reserved;
+    uint64_t console_ring;
+    uint64_t requests[];
+};
+
+/*
+ * Dodatne opcije iz komandne linije, sve imaju podrazumevane vrednosti.
+ */
+#define CONSOLE_BLOCK 0 // pun bafer: gost ceka da se bafer isprazni
+#define CONSOLE_DROP 1 // pun bafer: visak se odbacuje i broji
+
+struct options {
+    int console_policy;
+    size_t console_buffer;
+    bool coalesce; // konzolni port i registar preko coalesced MMIO/PIO
+    bool uring; // asinhroni zahtevi za fajlove preko io_uring
+    size_t hugepages; // 0 = obicne stranice, inace velicina velike stranice hosta
+    char *snapshot; // fajl za snimak stanja, NULL ako se ne snima
+    int snapshot_at;
+    bool ksm; // memorija gosta je MADV_MERGEABLE
+    int ksm_scan; // pages_to_scan, 0 = ne menja se
+    int ksm_sleep; // sleep_millisecs, 0 = ne menja se
+    bool ksm_zero_pages; // use_zero_pages
+    int reclaim; // kako se odbacuju stranice koje gost prijavi kao slobodne
+    int pool; // broj memorijskih regiona koji se cuvaju za sledece goste
+    int workers; // 0 = jedna nit po gostu, inace broj radnih niti izvrsioca
+    int quantum_ms; // najduze vreme koje gost provede na radnoj niti odjednom
+    int vcpus; // broj vCPU-a po gostu
+    int warm_pool; // najvise unapred napravljenih VM-ova, 0 = bez toplog poola
+    int numa; // raspored gostiju po NUMA cvorovima
+    int numa_list[64]; // cvorovi za --numa N,N,... (gost i dobija numa_list[i % numa_count])
+    int numa_count;
+    int pin; // raspored vCPU niti po procesorima
+    int pin_list[64]; // procesori za --pin N,N,... (gost i dobija pin_list[i % pin_count])
+    int pin_count;
+    cpu_set_t housekeeping; // procesori za pomocne niti, vCPU niti ih ne koriste
+};
+
+#define PIN_OFF 0
+#define PIN_COMPACT 1 // redom jezgra jednog paketa, SMT parovi jedan do drugog
+#define PIN_SPREAD 2 // prvo po jedno jezgro iz svakog paketa
+#define PIN_LIST 3
+
+#define MAX_WARM_VMS 64
+
+#define NUMA_OFF 0
+#define NUMA_AUTO 1 // gosti se redom dele na sve cvorove
+#define NUMA_MANUAL 2
+
+#define RECLAIM_DONTNEED 0 // odmah, RSS odmah pada
+#define RECLAIM_FREE 1 // lenjo (MADV_FREE), kernel ih uzima tek kada mu zatreba memorija
+
+#define SNAPSHOT_AT_EXIT 0 // posle prvog izlaska iz gosta
+#define SNAPSHOT_AT_HYPERCALL 1 // kada gost upise u MMIO_SNAPSHOT
+
+#define HUGE_2M (2UL << 20)
+#define HUGE_1G (1UL << 30)
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+static struct options opts = {
+    .console_policy = CONSOLE_BLOCK,
+    .console_buffer = 64 * 1024,
+    .coalesce = true,
+    .uring = true,
+    .quantum_ms = 10,
+    .vcpus = 1,
+};
+
+/*
+ * Jedan /dev/kvm za ceo proces. Mogucnosti KVM-a i hosta se proveravaju
+ * jednom u host_init, a pravljenje VM-a i brze putanje ih citaju odavde,
+ * bez novog otvaranja /dev/kvm i KVM_CHECK_EXTENSION za svakog gosta.
+ */
+static struct {
+    int kvm_fd;
+    int vcpu_mmap_size;
+    int max_vcpus;
+    int coalesced_mmio; // stranica coalesced prstena posle kvm_run, 0 ako ga nema
+    bool coalesced_pio;
+    bool ioeventfd;
+    bool readonly_mem;
+    bool xsave;
+    bool xcrs;
+    int sync_regs; // registri koji mogu da se prenesu kroz kvm_run (KVM_SYNC_X86_*)
+    int dirty_ring; // najveci dirty ring u bajtovima, 0 ako ga nema
+    struct kvm_cpuid2 *cpuid; // KVM_GET_SUPPORTED_CPUID
+    bool pdpe1gb; // 1GB stranice u CPUID-u gosta
+    long hugetlb_2m; // rezervisane i overcommit hugetlb stranice
+    long hugetlb_1g;
+    bool thp; // transparent_hugepage nije "never"
+} host = { .kvm_fd = -1 };
+
+#define CPUID_EXT_FEATURES 0x80000001
+#define CPUID_PDPE1GB (1U << 26)
+#define MAX_CPUID_ENTRIES 100 // pocetni broj, povecava se dok KVM vraca E2BIG
+#define CPUID_ENTRIES_LIMIT 4096
+#define HUGEPAGES_SYSFS "/sys/kernel/mm/hugepages/hugepages-"
+
+static int kvm_check(long cap)
 {
-    struct kvm_userspace_memory_region region;
-    int kvm_run_mmap_size;
+    int r = ioctl(host.kvm_fd, KVM_CHECK_EXTENSION, cap);
+    return r < 0 ? 0 : r;
+}
+
+static long read_long(const char *path)
+{
+    long value = 0;
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return 0;
+    if (fscanf(f, "%ld", &value) != 1) value = 0;
+    fclose(f);
+    return value;
+}
+
+static int host_init(void)
+{
+    char buf[128] = "";
+    FILE *f;
 
-    vm->kvm_fd = open("/dev/kvm", O_RDWR);
-    if (vm->kvm_fd < 0) {
+    host.kvm_fd = open("/dev/kvm", O_RDWR | O_CLOEXEC);
+    if (host.kvm_fd < 0) {
         perror("open /dev/kvm");
         return -1;
     }
+    if (ioctl(host.kvm_fd, KVM_GET_API_VERSION, 0) != KVM_API_VERSION) {
+        printf("KVM: unsupported API version\n");
+        return -1;
+    }
+    host.vcpu_mmap_size = ioctl(host.kvm_fd, KVM_GET_VCPU_MMAP_SIZE, 0);
+    if (host.vcpu_mmap_size <= 0) {
+        perror("KVM_GET_VCPU_MMAP_SIZE");
+        return -1;
+    }
+
+    host.max_vcpus = kvm_check(KVM_CAP_MAX_VCPUS);
+    if (host.max_vcpus == 0) host.max_vcpus = kvm_check(KVM_CAP_NR_VCPUS);
+    if (host.max_vcpus == 0) host.max_vcpus = 4; // KVM tada garantuje bar 4
+    host.coalesced_mmio = kvm_check(KVM_CAP_COALESCED_MMIO);
+    host.coalesced_pio = kvm_check(KVM_CAP_COALESCED_PIO) > 0;
+    host.ioeventfd = kvm_check(KVM_CAP_IOEVENTFD) > 0;
+    host.readonly_mem = kvm_check(KVM_CAP_READONLY_MEM) > 0;
+    host.xsave = kvm_check(KVM_CAP_XSAVE) > 0;
+    host.xcrs = kvm_check(KVM_CAP_XCRS) > 0;
+    host.sync_regs = kvm_check(KVM_CAP_SYNC_REGS);
+    host.dirty_ring = kvm_check(KVM_CAP_DIRTY_LOG_RING);
+
+    // noviji procesori imaju vise CPUID listova, E2BIG znaci da niz nije dovoljan
+    for (uint32_t nent = MAX_CPUID_ENTRIES; ; nent *= 2) {
+        free(host.cpuid);
+        host.cpuid = calloc(1, sizeof(*host.cpuid) + nent * sizeof(struct kvm_cpuid_entry2));
+        if (!host.cpuid) {
+            printf("Failed to allocate CPUID entries\n");
+            return -1;
+        }
+        host.cpuid->nent = nent;
+        if (ioctl(host.kvm_fd, KVM_GET_SUPPORTED_CPUID, host.cpuid) == 0) break;
+        if (errno != E2BIG || nent >= CPUID_ENTRIES_LIMIT) {
+            perror("KVM_GET_SUPPORTED_CPUID");
+            host.cpuid->nent = 0;
+            break;
+        }
+    }
+    for (uint32_t i = 0; i < host.cpuid->nent; i++) {
+        if (host.cpuid->entries[i].function == CPUID_EXT_FEATURES &&
+            (host.cpuid->entries[i].edx & CPUID_PDPE1GB)) {
+            host.pdpe1gb = true;
+        }
+    }
+
+    host.hugetlb_2m = read_long(HUGEPAGES_SYSFS "2048kB/nr_hugepages") +
+                      read_long(HUGEPAGES_SYSFS "2048kB/nr_overcommit_hugepages");
+    host.hugetlb_1g = read_long(HUGEPAGES_SYSFS "1048576kB/nr_hugepages") +
+                      read_long(HUGEPAGES_SYSFS "1048576kB/nr_overcommit_hugepages");
+    f = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+    if (f) {
+        if (fgets(buf, sizeof(buf), f) == NULL) buf[0] = '\0';
+        fclose(f);
+    }
+    host.thp = f != NULL && strstr(buf, "[never]") == NULL;
+    return 0;
+}
+
+/*
+ * Ispis na konzolu gost nikad ne cita nazad, pa upise na CONSOLE_PORT i
+ * MMIO_CONSOLE_DATA KVM moze da skuplja u prsten na stranici posle kvm_run,
+ * bez izlaska iz gosta. Prsten se prazni na pocetku obrade svakog izlaska
+ * (da bi redosled ostao isti) i kada gost stane.
+ */
+static void setup_coalesced_console(struct vm *vm)
+{
+    struct kvm_coalesced_mmio_zone zone;
+    long page_size = sysconf(_SC_PAGESIZE);
+    int offset = host.coalesced_mmio;
+
+    if (offset <= 0) {
+        return;
+    }
+
+    memset(&zone, 0, sizeof(zone));
+    zone.addr = MMIO_BASE + MMIO_CONSOLE_DATA;
+    zone.size = 8;
+    if (ioctl(vm->vm_fd, KVM_REGISTER_COALESCED_MMIO, &zone) < 0) {
+        perror("KVM_REGISTER_COALESCED_MMIO");
+        return;
+    }
+
+    if (host.coalesced_pio) {
+        memset(&zone, 0, sizeof(zone));
+        zone.addr = CONSOLE_PORT;
+        zone.size = 1;
+        zone.pio = 1;
+        if (ioctl(vm->vm_fd, KVM_REGISTER_COALESCED_MMIO, &zone) < 0) {
+            perror("KVM_REGISTER_COALESCED_MMIO pio");
+        }
+    }
+
+    // prsten je isti na svakom kvm_run mapiranju, koristi se onaj od vCPU 0
+    vm->coalesced = (void *)((char *)vm->vcpus[0].run + offset * page_size);
+    vm->coalesced_max = (page_size - sizeof(struct kvm_coalesced_mmio_ring)) /
+                        sizeof(struct kvm_coalesced_mmio);
+}
+
+/*
+ * Memorija gosta preko velikih stranica hosta, da bi i EPT koristio velike
+ * stranice. Prvo se proba hugetlbfs (MAP_HUGETLB), a ako nema rezervisanih
+ * stranica, THP preko madvise. Za THP adresa mora biti poravnata na 2MB,
+ * pa se uzima vise i odsece visak. Vraca MAP_FAILED ako nista ne uspe.
+ * Bez MAP_NORESERVE, jer bi tada mmap uspeo i bez stranica, a gost dobio SIGBUS.
+ */
+static char *alloc_huge_mem(size_t mem_size, size_t huge, size_t *page)
+{
+    char *mem;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+    int shift = huge == HUGE_1G ? 30 : 21;
+
+    if (mem_size % huge == 0 && (huge == HUGE_1G ? host.hugetlb_1g : host.hugetlb_2m) == 0) {
+        printf("Guest memory: no %zuMB hugetlb pages reserved, trying THP\n", huge >> 20);
+    } else if (mem_size % huge == 0) {
+        mem = mmap(NULL, mem_size, PROT_READ | PROT_WRITE,
+                   flags | (shift << MAP_HUGE_SHIFT), -1, 0);
+        if (mem != MAP_FAILED) {
+            printf("Guest memory: %zu x %zuMB hugetlb pages\n",
+                   mem_size / huge, huge >> 20);
+            *page = huge;
+            return mem;
+        }
+        printf("Guest memory: no %zuMB hugetlb pages (%s), trying THP\n",
+               huge >> 20, strerror(errno));
+    } else {
+        printf("Guest memory: %zuKB is not a multiple of %zuMB, trying THP\n",
+               mem_size >> 10, huge >> 20);
+    }
+
+    if (mem_size % HUGE_2M != 0) {
+        printf("Guest memory: %zuKB is not a multiple of 2MB, using 4KB pages\n",
+               mem_size >> 10);
+        return MAP_FAILED;
+    }
+    if (!host.thp) {
+        printf("Guest memory: THP is disabled on this host, using 4KB pages\n");
+        return MAP_FAILED;
+    }
+
+    char *raw = mmap(NULL, mem_size + HUGE_2M, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        return MAP_FAILED;
+    }
+    mem = (char *)(((uintptr_t)raw + HUGE_2M - 1) & ~(HUGE_2M - 1));
+    if (mem != raw) {
+        munmap(raw, mem - raw);
+    }
+    munmap(mem + mem_size, raw + HUGE_2M - mem);
+
+    if (madvise(mem, mem_size, MADV_HUGEPAGE) < 0) {
+        printf("Guest memory: THP unavailable (%s), using 4KB pages\n",
+               strerror(errno));
+        munmap(mem, mem_size);
+        return MAP_FAILED;
+    }
+    printf("Guest memory: THP requested for %zu x 2MB\n", mem_size / HUGE_2M);
+    // 1GB je trazen, ali iza memorije su 2MB stranice
+    *page = HUGE_2M;
+    return mem;
+}
+
+/*
+ * Pool memorije gostiju. Kada gost zavrsi, njegova memorija se ne unmapuje
+ * nego se ocisti i ceka sledeceg gosta iste velicine. Cisti se samo ono sto
+ * je prljavo: stranice koje su prisutne i pripadaju samo ovom procesu (bit
+ * 56 u pagemap) su upisane od gosta ili hosta, pa se odbacuju sa
+ * MADV_DONTNEED. Stranice koje su samo procitane pokazuju na zajednicku
+ * stranicu sa nulama i ostaju. Sa KSM-om spojene stranice nisu iskljucive,
+ * pa se tada odbacuje sve sto je prisutno.
+ */
+#define PAGEMAP_PRESENT (1ULL << 63)
+#define PAGEMAP_EXCLUSIVE (1ULL << 56)
+#define PAGEMAP_PFN_MASK ((1ULL << 55) - 1)
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#endif
+
+struct mem_region {
+    char *mem;
+    size_t size;
+    bool huge;
+    size_t page;
+    struct mem_region *next;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct mem_region *free;
+    int count;
+    uint64_t reused;
+    uint64_t reset_bytes;
+} mem_pool = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static char *alloc_guest_mem(size_t mem_size, bool *huge, size_t *page)
+{
+    char *mem = MAP_FAILED;
+
+    *huge = false;
+    *page = sysconf(_SC_PAGESIZE);
+    if (opts.hugepages) {
+        mem = alloc_huge_mem(mem_size, opts.hugepages, page);
+        *huge = mem != MAP_FAILED;
+    }
+    if (mem == MAP_FAILED) {
+        //stranice se zauzimaju tek kada ih gost dotakne
+        mem = mmap(NULL, mem_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    }
+    return mem;
+}
+
+static int vm_mem_get(struct vm *vm)
+{
+    if (opts.pool) {
+        pthread_mutex_lock(&mem_pool.lock);
+        for (struct mem_region **r = &mem_pool.free; *r; r = &(*r)->next) {
+            if ((*r)->size != vm->mem_size) continue;
+            struct mem_region *found = *r;
+            *r = found->next;
+            mem_pool.count--;
+            mem_pool.reused++;
+            pthread_mutex_unlock(&mem_pool.lock);
+            vm->mem = found->mem;
+            vm->mem_huge = found->huge;
+            vm->mem_page = found->page;
+            free(found);
+            return 0;
+        }
+        pthread_mutex_unlock(&mem_pool.lock);
+    }
+
+    vm->mem = alloc_guest_mem(vm->mem_size, &vm->mem_huge, &vm->mem_page);
+    return vm->mem == MAP_FAILED ? -1 : 0;
+}
+
+// Odbacuje jedan niz prljavih stranica i opet ih mapira samo za citanje.
+static int mem_reset_range(struct vm *vm, size_t start, size_t end, uint64_t *reset)
+{
+    if (end > vm->mem_size) end = vm->mem_size;
+    if (end <= start) return 0;
+    // ako odbacivanje ne uspe, stari sadrzaj bi procurio sledecem gostu
+    if (madvise(vm->mem + start, end - start, MADV_DONTNEED) < 0) {
+        perror("madvise reset guest memory");
+        return -1;
+    }
+    if (!vm->mem_huge) {
+        madvise(vm->mem + start, end - start, MADV_POPULATE_READ);
+    }
+    *reset += end - start;
+    return 0;
+}
+
+// Vraca memoriju u stanje kao posle alloc_guest_mem, dira samo prljave stranice.
+static int mem_reset(struct vm *vm)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t align = vm->mem_page;
+    uint64_t entries[512];
+    size_t run_start = 0, run_end = 0;
+    uint64_t reset = 0;
+
+    // slika ili snimak su mapirani iz fajla, tu opet ide anonimna memorija
+    if (vm->file_mapped && mmap(vm->mem, vm->file_mapped, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+                                -1, 0) == MAP_FAILED) {
+        return -1;
+    }
+
+    int pagemap = open("/proc/self/pagemap", O_RDONLY);
+    if (pagemap < 0) return -1;
+
+    size_t pages = vm->mem_size / page;
+    off_t first = ((uintptr_t)vm->mem / page) * sizeof(uint64_t);
+    for (size_t i = 0; i < pages; i++) {
+        if (i % 512 == 0) {
+            size_t n = pages - i < 512 ? pages - i : 512;
+            if (pread(pagemap, entries, n * sizeof(uint64_t), first + i * sizeof(uint64_t)) <= 0) {
+                close(pagemap);
+                return -1;
+            }
+        }
+        uint64_t e = entries[i % 512];
+        if (!(e & PAGEMAP_PRESENT) || !(opts.ksm || (e & PAGEMAP_EXCLUSIVE))) continue;
+
+        // susedne prljave stranice idu u jedan madvise
+        size_t start = (i * page) & ~(align - 1);
+        size_t end = (i * page + page + align - 1) & ~(align - 1);
+        if (run_end > run_start && start <= run_end) {
+            if (end > run_end) run_end = end;
+            continue;
+        }
+        if (mem_reset_range(vm, run_start, run_end, &reset) < 0) {
+            close(pagemap);
+            return -1;
+        }
+        run_start = start;
+        run_end = end;
+    }
+    close(pagemap);
+    if (mem_reset_range(vm, run_start, run_end, &reset) < 0) return -1;
+
+    pthread_mutex_lock(&mem_pool.lock);
+    mem_pool.reset_bytes += reset;
+    pthread_mutex_unlock(&mem_pool.lock);
+    return 0;
+}
+
+static void vm_mem_put(struct vm *vm)
+{
+    if (vm->mem == MAP_FAILED) return;
+
+    pthread_mutex_lock(&mem_pool.lock);
+    bool keep = mem_pool.count < opts.pool;
+    if (keep) mem_pool.count++;
+    pthread_mutex_unlock(&mem_pool.lock);
+
+    if (keep && mem_reset(vm) == 0) {
+        struct mem_region *r = malloc(sizeof(*r));
+        r->mem = vm->mem;
+        r->size = vm->mem_size;
+        r->huge = vm->mem_huge;
+        r->page = vm->mem_page;
+        pthread_mutex_lock(&mem_pool.lock);
+        r->next = mem_pool.free;
+        mem_pool.free = r;
+        pthread_mutex_unlock(&mem_pool.lock);
+        return;
+    }
+    if (keep) {
+        pthread_mutex_lock(&mem_pool.lock);
+        mem_pool.count--;
+        pthread_mutex_unlock(&mem_pool.lock);
+    }
+    munmap(vm->mem, vm->mem_size);
+}
+
+// Unapred pravi regione za prve goste, stranice se mapiraju samo za citanje.
+static void mem_pool_init(size_t mem_size, int count)
+{
+    for (int i = 0; i < count; i++) {
+        bool huge;
+        size_t page;
+        char *mem = alloc_guest_mem(mem_size, &huge, &page);
+        if (mem == MAP_FAILED) {
+            perror("mmap pool");
+            return;
+        }
+        if (!huge) {
+            madvise(mem, mem_size, MADV_POPULATE_READ);
+        }
+        struct mem_region *r = malloc(sizeof(*r));
+        r->mem = mem;
+        r->size = mem_size;
+        r->huge = huge;
+        r->page = page;
+        r->next = mem_pool.free;
+        mem_pool.free = r;
+        mem_pool.count++;
+    }
+}
+
+static void mem_pool_report(void)
+{
+    printf("Memory pool: %d regions kept, %lu guests reused a region, %lu KB reset\n",
+           mem_pool.count, mem_pool.reused, mem_pool.reset_bytes >> 10);
+}
 
-    vm->vm_fd = ioctl(vm->kvm_fd, KVM_CREATE_VM, 0);
+int init_vm(struct vm *vm, size_t mem_size, int num_vcpus)
+{
+    struct kvm_userspace_memory_region region;
+    // destroy_vm zna da oslobodi i delimicno napravljenu VM
+    vm->vm_fd = -1;
+    vm->num_vcpus = 0;
+    vm->mem = MAP_FAILED;
+    vm->pt_tables = NULL;
+    vm->file_mapped = 0;
+    pthread_mutex_init(&vm->console_lock, NULL);
+
+    vm->vm_fd = ioctl(host.kvm_fd, KVM_CREATE_VM, 0);
     if (vm->vm_fd < 0) {
         perror("KVM_CREATE_VM");
         return -1;
     }
 
-    vm->mem = mmap(NULL, mem_size, PROT_READ | PROT_WRITE,
-                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-    if (vm->mem == MAP_FAILED) {
+    vm->mem_size = mem_size;
+    if (vm_mem_get(vm) < 0) {
         perror("mmap mem");
         return -1;
     }
@@ -70,673 +693,3847 @@ int init_vm(struct vm *vm, size_t mem_size)
         return -1;
     }
 
-    vm->vcpu_fd = ioctl(vm->vm_fd, KVM_CREATE_VCPU, 0);
-    if (vm->vcpu_fd < 0) {
-        perror("KVM_CREATE_VCPU");
-        return -1;
+    for (int i = 0; i < num_vcpus; i++) {
+        struct vcpu *cpu = &vm->vcpus[i];
+
+        cpu->fd = ioctl(vm->vm_fd, KVM_CREATE_VCPU, i);
+        if (cpu->fd < 0) {
+            perror("KVM_CREATE_VCPU");
+            return -1;
+        }
+        vm->num_vcpus++;
+        cpu->run = mmap(NULL, host.vcpu_mmap_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, cpu->fd, 0);
+        if (cpu->run == MAP_FAILED) {
+            perror("mmap kvm_run");
+            return -1;
+        }
     }
 
-    kvm_run_mmap_size = ioctl(vm->kvm_fd, KVM_GET_VCPU_MMAP_SIZE, 0);
-    if (kvm_run_mmap_size <= 0) {
-        perror("KVM_GET_VCPU_MMAP_SIZE");
-        return -1;
+    vm->coalesced = NULL;
+    vm->snapshot_requested = false;
+    vm->reclaimed_bytes = 0;
+    vm->free_reports = 0;
+    if (opts.coalesce) {
+        setup_coalesced_console(vm);
     }
 
-    vm->kvm_run = mmap(NULL, kvm_run_mmap_size, PROT_READ | PROT_WRITE,
-                       MAP_SHARED, vm->vcpu_fd, 0);
-    if (vm->kvm_run == MAP_FAILED) {
-        perror("mmap kvm_run");
-        return -1;
+    return 0;
+}
+
+// Zatvara sve sto je init_vm otvorio, memorija se vraca u pool.
+static void destroy_vm(struct vm *vm)
+{
+    for (int i = 0; i < vm->num_vcpus; i++) {
+        if (vm->vcpus[i].run != MAP_FAILED) munmap(vm->vcpus[i].run, host.vcpu_mmap_size);
+        close(vm->vcpus[i].fd);
     }
+    if (vm->pt_tables) munmap(vm->pt_tables, vm->pt_size);
+    if (vm->vm_fd >= 0) close(vm->vm_fd);
+    vm_mem_put(vm);
+    pthread_mutex_destroy(&vm->console_lock);
+}
+
+/*
+ * KSM spaja iste stranice razlicitih gostiju (kod, nule, iste podatke).
+ * Slika i tabele stranica su vec deljene kroz memfd, KSM pokriva ostatak.
+ * Podesavanja su globalna za host, u /sys/kernel/mm/ksm.
+ */
+#define KSM_SYSFS "/sys/kernel/mm/ksm/"
+#define KPF_KSM 21
+#define KPF_ZERO_PAGE 24
 
+static int ksm_write(const char *name, long value)
+{
+    char path[128];
+    FILE *f;
+
+    snprintf(path, sizeof(path), KSM_SYSFS "%s", name);
+    f = fopen(path, "w");
+    if (f == NULL) {
+        printf("KSM: can not set %s (%s)\n", name, strerror(errno));
+        return -1;
+    }
+    fprintf(f, "%ld\n", value);
+    if (fclose(f) != 0) {
+        printf("KSM: can not set %s (%s)\n", name, strerror(errno));
+        return -1;
+    }
     return 0;
 }
 
-static void setup_64bit_code_segment(struct kvm_sregs *sregs)
+static long ksm_read(const char *name)
 {
-    struct kvm_segment seg = {
-            .base = 0,
-            .limit = 0xffffffff,
-            .present = 1, // Prisutan ili učitan u memoriji
-            .type = 11, // Code: execute, read, accessed
-            .dpl = 0, // Descriptor Privilage Level: 0 (0, 1, 2, 3)
-            .db = 0, // Default size - ima vrednost 0 u long modu
-            .s = 1, // Code/data tip segmenta
-            .l = 1, // Long mode - 1
-            .g = 1, // 4KB granularnost
-    };
+    char path[128];
+    long value = -1;
+    FILE *f;
 
-    sregs->cs = seg;
+    snprintf(path, sizeof(path), KSM_SYSFS "%s", name);
+    f = fopen(path, "r");
+    if (f == NULL) return -1;
+    if (fscanf(f, "%ld", &value) != 1) value = -1;
+    fclose(f);
+    return value;
+}
 
-    seg.type = 3; // Data: read, write, accessed
-    sregs->ds = sregs->es = sregs->fs = sregs->gs = sregs->ss = seg;
+static void ksm_setup(void)
+{
+    if (opts.ksm_scan > 0) ksm_write("pages_to_scan", opts.ksm_scan);
+    if (opts.ksm_sleep > 0) ksm_write("sleep_millisecs", opts.ksm_sleep);
+    if (opts.ksm_zero_pages) ksm_write("use_zero_pages", 1);
+    ksm_write("run", 1);
 }
 
-// Omogucavanje long moda.
-// Vise od long modu mozete prociati o stranicenju u glavi 5:
-// https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24593.pdf
-// Pogledati figuru 5.1 na stranici 128.
-static void setup_long_mode(struct vm *vm, struct kvm_sregs *sregs, size_t memSize, size_t pageSize)
+// Poziva se kada je memorija konacna, MAP_FIXED (slika, snimak) brise oznaku.
+static void ksm_register(struct vm *vm)
 {
-    // Postavljanje 4 niva ugnjezdavanja.
-    // Svaka tabela stranica ima 512 ulaza, a svaki ulaz je veličine 8B.
-    // Odatle sledi da je veličina tabela stranica 4KB. Ove tabele moraju da budu poravnate na 4KB.
-    uint64_t page = 0;
-    uint64_t pml4_addr = 0x1000;
-    uint64_t *pml4 = (void *)(vm->mem + pml4_addr);
+    if (madvise(vm->mem, vm->mem_size, MADV_MERGEABLE) < 0) {
+        printf("KSM: madvise failed for guest %d (%s)\n", vm->id, strerror(errno));
+    }
+}
 
-    uint64_t pdpt_addr = 0x2000;
-    uint64_t *pdpt = (void *)(vm->mem + pdpt_addr);
+/*
+ * Broji stranice gosta koje je KSM spojio, preko /proc/self/pagemap
+ * (PFN svake stranice) i /proc/kpageflags (KPF_KSM i KPF_ZERO_PAGE).
+ */
+static void ksm_report(struct vm *vm)
+{
+    int pagemap = open("/proc/self/pagemap", O_RDONLY);
+    int kpageflags = open("/proc/kpageflags", O_RDONLY);
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t resident = 0, merged = 0, zero = 0;
+    uint64_t entries[512];
 
-    uint64_t pd_addr = 0x3000;
-    uint64_t *pd = (void *)(vm->mem + pd_addr);
+    if (pagemap < 0 || kpageflags < 0) {
+        printf("KSM: can not read page flags (%s)\n", strerror(errno));
+        goto out;
+    }
 
-    pml4[0] = PDE64_PRESENT | PDE64_RW | PDE64_USER | pdpt_addr;
-    pdpt[0] = PDE64_PRESENT | PDE64_RW | PDE64_USER | pd_addr;
+    size_t pages = vm->mem_size / page;
+    off_t first = ((uintptr_t)vm->mem / page) * sizeof(uint64_t);
+    for (size_t i = 0; i < pages; i += 512) {
+        size_t n = pages - i < 512 ? pages - i : 512;
+        if (pread(pagemap, entries, n * sizeof(uint64_t), first + i * sizeof(uint64_t)) <= 0) {
+            break;
+        }
+        for (size_t j = 0; j < n; j++) {
+            uint64_t flags;
+            if (!(entries[j] & PAGEMAP_PRESENT)) continue;
+            resident++;
+            uint64_t pfn = entries[j] & PAGEMAP_PFN_MASK;
+            if (pread(kpageflags, &flags, sizeof(flags), pfn * sizeof(flags)) != sizeof(flags)) {
+                continue;
+            }
+            if (flags & (1ULL << KPF_KSM)) merged++;
+            else if (flags & (1ULL << KPF_ZERO_PAGE)) zero++;
+        }
+    }
+    printf("KSM guest %d: %zu resident pages, %zu merged, %zu zero\n",
+           vm->id, resident, merged, zero);
 
-    size_t pages = memSize / pageSize;
+out:
+    if (pagemap >= 0) close(pagemap);
+    if (kpageflags >= 0) close(kpageflags);
+}
 
-    switch (pageSize) {
-        case 4 * 1024:
-            uint64_t pt_addr = 0x6000;
-            uint64_t *pt = (void *)(vm->mem + pt_addr);
+static void ksm_summary(void)
+{
+    printf("KSM: pages_shared %ld, pages_sharing %ld, full_scans %ld, general_profit %ld\n",
+           ksm_read("pages_shared"), ksm_read("pages_sharing"),
+           ksm_read("full_scans"), ksm_read("general_profit"));
+}
 
+/*
+ * NUMA raspored: memorija gosta se vezuje za jedan cvor (mbind), a nit
+ * vCPU-a (i I/O nit koju ona pravi) sme da radi samo na procesorima tog
+ * cvora. Cvorovi i njihovi procesori se citaju iz sysfs, a sistemski pozivi
+ * idu direktno, bez libnuma. Na kraju se sabira koliko memorije gostiju je
+ * zavrsilo na kom cvoru (iz /proc/self/numa_maps).
+ */
+#define MAX_NUMA_NODES 64
+#define NUMA_SYSFS "/sys/devices/system/node/"
 
-            for (size_t i = 0; i < pages; i++) {
-                pd[i] = PDE64_PRESENT | PDE64_PRESENT | PDE64_RW | PDE64_USER | PDE64_PS;
-                page += pageSize;
-            }
+struct numa_node {
+    bool online;
+    cpu_set_t cpus;
+    int guests;
+    uint64_t bytes; // memorija gostiju na ovom cvoru
+};
 
-            pt[0] = page | PDE64_PRESENT | PDE64_RW | PDE64_USER;
-            pt[511] = 0x8000 | PDE64_PRESENT | PDE64_RW | PDE64_USER;
+static struct numa_node numa_nodes[MAX_NUMA_NODES];
+static int numa_online[MAX_NUMA_NODES];
+static int num_numa_online;
+static pthread_mutex_t numa_lock = PTHREAD_MUTEX_INITIALIZER;
 
-            printf("%d\n",pages);
-            for (size_t i = 0; i < pages; i++) {
-                pt[i] = page | PDE64_PRESENT | PDE64_RW | PDE64_USER;
-                page += pageSize;
-            }
-            printf("%lx\n",page);
-            break;
-        case 2 * 1024 * 1024:
-            for (size_t i = 0; i < pages; i++) {
-                pd[i] = page | PDE64_PRESENT | PDE64_RW | PDE64_USER | PDE64_PS;
-                page += pageSize;
-            }
-            break;
+// Cita listu oblika "0-3,8,10-11" i poziva set za svaki broj.
+static void parse_range_list(const char *list, void (*set)(int, void *), void *arg)
+{
+    const char *p = list;
+    while (*p && *p != '\n') {
+        char *end;
+        long from = strtol(p, &end, 10), to = from;
+        if (end == p) break;
+        if (*end == '-') to = strtol(end + 1, &end, 10);
+        for (long i = from; i <= to; i++) set((int)i, arg);
+        p = *end == ',' ? end + 1 : end;
     }
+}
 
-    // Registar koji ukazuje na PML4 tabelu stranica. Odavde kreće mapiranje VA u PA.
-    sregs->cr3  = pml4_addr;
-    sregs->cr4  = CR4_PAE; // "Physical Address Extension" mora biti 1 za long mode.
-    sregs->cr0  = CR0_PE | CR0_PG; // Postavljanje "Protected Mode" i "Paging"
-    sregs->efer = EFER_LME | EFER_LMA; // Postavljanje  "Long Mode Active" i "Long Mode Enable"
+static void set_node_online(int node, void *arg)
+{
+    if (node < MAX_NUMA_NODES) numa_nodes[node].online = true;
+}
 
-    // Inicijalizacija segmenata procesora.
-    setup_64bit_code_segment(sregs);
+static void set_cpu(int cpu, void *arg)
+{
+    if (cpu < CPU_SETSIZE) CPU_SET(cpu, (cpu_set_t *)arg);
 }
 
-void printUsage() {
-    printf("Usage: program_name [options]\n");
-    printf("Options:\n");
-    printf("  -m, --memory <2|4|8>   Set memory size (in GB)\n");
-    printf("  -p, --page <2|4>       Set page size (in KB)\n");
-    printf("  -g, --guest <file.img> Specify guest image file\n");
+static bool read_line(const char *path, char *buf, size_t len)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return false;
+    bool ok = fgets(buf, len, f) != NULL;
+    fclose(f);
+    return ok;
 }
 
-bool check_arguments(int argc, char* argv[],char*** img, int* mem_size, int* page_size,int* num_guests,char*** shared_files, int* num_shared){
+static int numa_init(void)
+{
+    char buf[4096], path[128];
 
-    for (int i = 1; i < argc; i++) {
+    if (!read_line(NUMA_SYSFS "online", buf, sizeof(buf))) {
+        printf("NUMA: no node information in sysfs, placement is off\n");
+        opts.numa = NUMA_OFF;
+        return 0;
+    }
+    parse_range_list(buf, set_node_online, NULL);
+    for (int n = 0; n < MAX_NUMA_NODES; n++) {
+        if (!numa_nodes[n].online) continue;
+        numa_online[num_numa_online++] = n;
+        CPU_ZERO(&numa_nodes[n].cpus);
+        snprintf(path, sizeof(path), NUMA_SYSFS "node%d/cpulist", n);
+        if (read_line(path, buf, sizeof(buf))) {
+            parse_range_list(buf, set_cpu, &numa_nodes[n].cpus);
+        }
+    }
 
-        if (strcmp(argv[i], "--memory") == 0 || strcmp(argv[i], "-m") == 0) {
-            if (i + 1 < argc) {
-                *mem_size = atoi(argv[i + 1]);
-                i++; // Skip the next argument
-            } else {
-                printf("Error: Missing memory size argument.\n");
-                printUsage();
-                return false;
-            }
-        } else if (strcmp(argv[i], "--page") == 0 || strcmp(argv[i], "-p") == 0) {
-            if (i + 1 < argc) {
-                *page_size = atoi(argv[i + 1]);
-                i++; // Skip the next argument
-            } else {
-                printf("Error: Missing page size argument.\n");
-                printUsage();
-                return false;
-            }
-        } else if (strcmp(argv[i], "--guest") == 0 || strcmp(argv[i], "-g") == 0) {
-            int c =0;
-            if (argc - (i+1) == 0){
+    for (int i = 0; i < opts.numa_count; i++) {
+        int n = opts.numa_list[i];
+        if (n < 0 || n >= MAX_NUMA_NODES || !numa_nodes[n].online) {
+            printf("NUMA: node %d is not online\n", n);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int numa_pick(int id)
+{
+    if (opts.numa == NUMA_MANUAL) return opts.numa_list[id % opts.numa_count];
+    return numa_online[id % num_numa_online];
+}
+
+// Nit (i niti koje ona napravi) radi na procesorima cvora i tamo zauzima memoriju.
+// Sa --pin procesor bira politika vezivanja, cvor odredjuje samo memoriju.
+static void numa_bind_thread(int node)
+{
+    unsigned long mask = 1UL << node;
+    cpu_set_t cpus, hk;
+
+    // procesori za pomocne niti se preskacu, osim ako cvor nema drugih
+    CPU_AND(&hk, &numa_nodes[node].cpus, &opts.housekeeping);
+    CPU_XOR(&cpus, &numa_nodes[node].cpus, &hk);
+    if (CPU_COUNT(&cpus) == 0) cpus = numa_nodes[node].cpus;
+
+    if (opts.pin == PIN_OFF && CPU_COUNT(&cpus) > 0 &&
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus) != 0) {
+        printf("NUMA: can not pin thread to node %d\n", node);
+    }
+    if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, MAX_NUMA_NODES + 1) < 0) {
+        perror("set_mempolicy");
+    }
+}
+
+// Memorija gosta sme da bude samo na cvoru, vec zauzete stranice se premestaju.
+static void numa_bind_memory(struct vm *vm, int node)
+{
+    unsigned long mask = 1UL << node;
+
+    if (syscall(SYS_mbind, vm->mem, vm->mem_size, MPOL_BIND, &mask,
+                MAX_NUMA_NODES + 1, MPOL_MF_MOVE) < 0) {
+        printf("NUMA: mbind to node %d failed for guest %d (%s)\n", node, vm->id, strerror(errno));
+    }
+}
+
+// Sabira stranice gosta po cvorovima iz /proc/self/numa_maps.
+static void numa_account(struct vm *vm, int node)
+{
+    char line[1024];
+    FILE *f = fopen("/proc/self/numa_maps", "r");
+
+    pthread_mutex_lock(&numa_lock);
+    numa_nodes[node].guests++;
+    while (f && fgets(line, sizeof(line), f)) {
+        uintptr_t start = strtoull(line, NULL, 16);
+        if (start < (uintptr_t)vm->mem || start >= (uintptr_t)vm->mem + vm->mem_size) continue;
+
+        uint64_t page_kb = 4;
+        char *p = strstr(line, "kernelpagesize_kB=");
+        if (p) page_kb = strtoull(p + 18, NULL, 10);
+        for (p = strstr(line, " N"); p; p = strstr(p + 1, " N")) {
+            char *end;
+            long n = strtol(p + 2, &end, 10);
+            if (*end != '=' || n < 0 || n >= MAX_NUMA_NODES) continue;
+            numa_nodes[n].bytes += strtoull(end + 1, NULL, 10) * page_kb * 1024;
+        }
+    }
+    pthread_mutex_unlock(&numa_lock);
+    if (f) fclose(f);
+}
+
+static void numa_report(void)
+{
+    char path[128], buf[256];
+
+    for (int i = 0; i < num_numa_online; i++) {
+        int n = numa_online[i];
+        unsigned long long total = 0, free_kb = 0;
+        snprintf(path, sizeof(path), NUMA_SYSFS "node%d/meminfo", n);
+        FILE *f = fopen(path, "r");
+        while (f && fgets(buf, sizeof(buf), f)) {
+            char *p;
+            if ((p = strstr(buf, "MemTotal:"))) total = strtoull(p + 9, NULL, 10);
+            if ((p = strstr(buf, "MemFree:"))) free_kb = strtoull(p + 8, NULL, 10);
+        }
+        if (f) fclose(f);
+        printf("NUMA node %d: %d guests, %lu KB guest memory, %llu of %llu MB free\n",
+               n, numa_nodes[n].guests, numa_nodes[n].bytes >> 10, free_kb >> 10, total >> 10);
+    }
+}
+
+/*
+ * Vezivanje niti za procesore (--pin). Gost (ili radna nit izvrsioca) i
+ * dobija i-ti procesor po politici: compact puni redom jezgra jednog paketa
+ * sa SMT parovima jedan do drugog, spread uzima prvo po jedno jezgro iz
+ * svakog paketa, a lista daje procesor svakom gostu. Procesori iz
+ * --housekeeping se ne daju vCPU nitima, na njima rade konzola i I/O niti.
+ */
+struct pin_cpu {
+    int cpu;
+    int package;
+    int core;
+    int thread; // redni broj medju SMT parovima jezgra
+    int core_rank; // redni broj jezgra u paketu
+};
+
+static const char *pin_names[] = { "unpinned", "compact", "spread", "list" };
+static int pin_order[CPU_SETSIZE];
+static int num_pin_cpus;
+static cpu_set_t pin_vcpus; // procesori za vCPU niti
+static cpu_set_t pin_helpers; // procesori za pomocne niti
+
+static bool pin_active(void)
+{
+    return opts.pin != PIN_OFF || CPU_COUNT(&opts.housekeeping) > 0;
+}
+
+static int topology_value(int cpu, const char *name)
+{
+    char path[128], buf[32];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+    return read_line(path, buf, sizeof(buf)) ? atoi(buf) : 0;
+}
+
+static int pin_compare(const void *a, const void *b)
+{
+    const struct pin_cpu *x = a, *y = b;
+
+    if (opts.pin == PIN_SPREAD) {
+        if (x->thread != y->thread) return x->thread - y->thread;
+        if (x->core_rank != y->core_rank) return x->core_rank - y->core_rank;
+        if (x->package != y->package) return x->package - y->package;
+    } else {
+        if (x->package != y->package) return x->package - y->package;
+        if (x->core != y->core) return x->core - y->core;
+    }
+    return x->cpu - y->cpu;
+}
+
+static int pin_init(void)
+{
+    cpu_set_t allowed;
+    struct pin_cpu *cpus;
+    int n = 0;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        perror("sched_getaffinity");
+        return -1;
+    }
+    CPU_AND(&pin_helpers, &allowed, &opts.housekeeping);
+    CPU_XOR(&pin_vcpus, &allowed, &pin_helpers);
+    if (CPU_COUNT(&opts.housekeeping) > 0 && CPU_COUNT(&pin_helpers) == 0) {
+        printf("Pin: none of the housekeeping CPUs is available\n");
+        return -1;
+    }
+    if (CPU_COUNT(&pin_helpers) == 0) pin_helpers = allowed;
+    if (CPU_COUNT(&pin_vcpus) == 0) {
+        printf("Pin: no CPU left for guests after the housekeeping CPUs\n");
+        return -1;
+    }
+
+    if (opts.pin == PIN_LIST) {
+        for (int i = 0; i < opts.pin_count; i++) {
+            int cpu = opts.pin_list[i];
+            if (cpu < 0 || cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed)) {
+                printf("Pin: CPU %d is not available\n", cpu);
+                return -1;
+            }
+            if (CPU_ISSET(cpu, &pin_helpers) && CPU_COUNT(&opts.housekeeping) > 0) {
+                printf("Pin: CPU %d is also a housekeeping CPU\n", cpu);
+            }
+        }
+        return 0;
+    }
+    if (opts.pin == PIN_OFF) return 0;
+
+    cpus = calloc(CPU_COUNT(&pin_vcpus), sizeof(*cpus));
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &pin_vcpus)) continue;
+        cpus[n].cpu = cpu;
+        cpus[n].package = topology_value(cpu, "physical_package_id");
+        cpus[n].core = topology_value(cpu, "core_id");
+        for (int j = 0; j < n; j++) {
+            if (cpus[j].package == cpus[n].package && cpus[j].core == cpus[n].core) cpus[n].thread++;
+        }
+        n++;
+    }
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            if (cpus[j].thread == 0 && cpus[j].package == cpus[i].package && cpus[j].core < cpus[i].core) {
+                cpus[i].core_rank++;
+            }
+        }
+    }
+    qsort(cpus, n, sizeof(*cpus), pin_compare);
+
+    printf("Pin: %s over %d CPUs:", pin_names[opts.pin], n);
+    for (int i = 0; i < n; i++) {
+        pin_order[i] = cpus[i].cpu;
+        printf(" %d", cpus[i].cpu);
+    }
+    printf("\n");
+    num_pin_cpus = n;
+    free(cpus);
+    return 0;
+}
+
+// Vezuje vCPU nit gosta (ili radnu nit) sa rednim brojem index.
+static void pin_thread(int index)
+{
+    cpu_set_t set = pin_vcpus;
+    int cpu = -1;
+
+    if (opts.pin == PIN_LIST) cpu = opts.pin_list[index % opts.pin_count];
+    else if (opts.pin != PIN_OFF) cpu = pin_order[index % num_pin_cpus];
+    if (cpu >= 0) {
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+    }
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        printf("Pin: can not pin thread %d to CPU %d\n", index, cpu);
+    }
+}
+
+// Pomocna nit ne ostaje na procesoru vCPU niti koja ju je napravila.
+static void pin_helper(void)
+{
+    if (pin_active()) {
+        pthread_setaffinity_np(pthread_self(), sizeof(pin_helpers), &pin_helpers);
+    }
+}
+
+/*
+ * Histogram latencija, cetiri podeoka po stepenu dvojke (greska do 25%),
+ * da bi se videli repovi raspodele (p99, p99.9) bez cuvanja svih uzoraka.
+ */
+#define LAT_BUCKETS (64 * 4)
+
+struct lat_hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[LAT_BUCKETS];
+};
+
+static int lat_bucket(uint64_t ns)
+{
+    if (ns < 4) return ns;
+    int log = 63 - __builtin_clzll(ns);
+    return log * 4 + ((ns >> (log - 2)) & 3);
+}
+
+// najveca vrednost koja pada u podeok
+static uint64_t lat_bucket_top(int b)
+{
+    if (b < 8) return b; // podeoci 4-7 se ne koriste
+    return ((uint64_t)(4 + b % 4 + 1) << (b / 4 - 2)) - 1;
+}
+
+static void lat_record(struct lat_hist *h, uint64_t ns)
+{
+    h->count++;
+    h->sum += ns;
+    if (ns > h->max) h->max = ns;
+    h->buckets[lat_bucket(ns)]++;
+}
+
+static void lat_merge(struct lat_hist *to, const struct lat_hist *from)
+{
+    to->count += from->count;
+    to->sum += from->sum;
+    if (from->max > to->max) to->max = from->max;
+    for (int i = 0; i < LAT_BUCKETS; i++) to->buckets[i] += from->buckets[i];
+}
+
+static uint64_t lat_percentile(const struct lat_hist *h, double p)
+{
+    uint64_t want = (uint64_t)(h->count * p), seen = 0;
+
+    for (int i = 0; i < LAT_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen > want) return lat_bucket_top(i) < h->max ? lat_bucket_top(i) : h->max;
+    }
+    return h->max;
+}
+
+static void lat_print(const char *name, const struct lat_hist *h)
+{
+    if (h->count == 0) return;
+    printf("%s: %lu samples, avg %.1f us, p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+           name, h->count, h->sum / 1e3 / h->count, lat_percentile(h, 0.5) / 1e3,
+           lat_percentile(h, 0.99) / 1e3, lat_percentile(h, 0.999) / 1e3, h->max / 1e3);
+}
+
+// vreme od izlaska iz KVM_RUN do sledeceg ulaska, za sve goste
+static struct lat_hist exit_latency;
+static pthread_mutex_t exit_latency_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Konzola za sve goste. Svaki gost ima svoj kruzni bafer (jedan proizvodjac,
+ * jedan potrosac) u koji upisuje bez zakljucavanja stdout-a, a jedna nit
+ * prazni sve bafere velikim writev pozivima. Kada radi vise gostiju, svaki
+ * red dobija oznaku gosta; nepotpuni redovi se ispisuju tek kada stigne '\n',
+ * kada gost zavrsi ili kada red ceka duze od CONSOLE_PARTIAL_NS.
+ * Kada je bafer pun, opts.console_policy odredjuje da li gost ceka ili se
+ * visak odbacuje; oba slucaja se broje u statistici.
+ */
+#define CONSOLE_IOV 256
+#define CONSOLE_PARTIAL_NS 50000000ULL
+#define CONSOLE_IDLE_WAIT_NS 10000000
+
+struct guest_console {
+    char *buf;
+    uint64_t head; // proizvodjac
+    uint64_t tail; // potrosac
+    // vCPU nit i I/O nit iste VM su oba proizvodjaci
+    pthread_mutex_t producer_lock;
+    bool closed;
+    bool midline; // poslednji bajt gosta nije '\n'
+    // proizvodjac ceka na space kada je bafer pun (CONSOLE_BLOCK)
+    sem_t space;
+    int waiting;
+
+    // statistika
+    uint64_t written;
+    uint64_t dropped;
+    uint64_t waits;
+
+    // stanje potrosaca
+    bool line_start;
+    uint64_t partial_since;
+    char tag[32];
+    int tag_len;
+};
+
+static struct {
+    struct guest_console *consoles;
+    int count;
+    size_t size; // velicina bafera, stepen dvojke
+    bool tagged;
+    pthread_t thread;
+    sem_t wake;
+    int idle;
+    bool stop;
+} console;
+
+static uint64_t now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void console_wake(bool force){
+    if (__atomic_exchange_n(&console.idle, 0, __ATOMIC_SEQ_CST) || force){
+        sem_post(&console.wake);
+    }
+}
+
+// Kopira u bafer, poziva se pod producer_lock. Poruke hosta se ne odbacuju i ne broje.
+static void console_copy(struct guest_console *c, const char *data, size_t len, bool host){
+    uint64_t head, tail;
+    size_t chunk, pos, first;
+
+    head = c->head;
+    while (len > 0){
+        tail = __atomic_load_n(&c->tail, __ATOMIC_ACQUIRE);
+        chunk = console.size - (head - tail);
+        if (chunk == 0 && !host && opts.console_policy == CONSOLE_DROP){
+            c->dropped += len;
+            break;
+        }
+        if (chunk == 0){
+            //bafer je pun, cekamo da ga nit za ispis isprazni
+            c->waits++;
+            __atomic_store_n(&c->waiting, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&c->tail, __ATOMIC_SEQ_CST) == tail){
+                console_wake(true);
+                sem_wait(&c->space);
+            }
+            else{
+                __atomic_store_n(&c->waiting, 0, __ATOMIC_SEQ_CST);
+            }
+            continue;
+        }
+        if (chunk > len) chunk = len;
+
+        pos = head & (console.size - 1);
+        first = console.size - pos;
+        if (first > chunk) first = chunk;
+        memcpy(c->buf + pos, data, first);
+        memcpy(c->buf, data + first, chunk - first);
+
+        if (!host) c->midline = data[chunk - 1] != '\n';
+        head += chunk;
+        data += chunk;
+        len -= chunk;
+        if (!host) c->written += chunk;
+        __atomic_store_n(&c->head, head, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+ * Upisuje podatke gosta id u njegov bafer. Kada je bafer pun gost ceka
+ * (CONSOLE_BLOCK) ili se ostatak odbacuje (CONSOLE_DROP).
+ */
+static void console_write(int id, const char *data, size_t len){
+    struct guest_console *c = &console.consoles[id];
+
+    if (len == 0) return;
+
+    pthread_mutex_lock(&c->producer_lock);
+    console_copy(c, data, len, false);
+    pthread_mutex_unlock(&c->producer_lock);
+    console_wake(false);
+}
+
+/*
+ * Poruka hosta o gostu id ide kroz isti bafer kao izlaz gosta, pa se ne
+ * ispisuje pre onoga sto je gost upisao ranije.
+ */
+static void guest_printf(int id, const char *fmt, ...){
+    struct guest_console *c;
+    char buf[256];
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (n <= 0) return;
+    // VM iz toplog bazena se pravi pre konzole, tada ide direktno na stdout
+    if (id < 0 || id >= __atomic_load_n(&console.count, __ATOMIC_ACQUIRE)) {
+        fputs(buf, stdout);
+        return;
+    }
+    c = &console.consoles[id];
+    if (n >= (int)sizeof(buf)) n = sizeof(buf) - 1;
+
+    pthread_mutex_lock(&c->producer_lock);
+    // nepotpun red gosta se zavrsava pre poruke
+    if (c->midline) console_copy(c, "\n", 1, true);
+    console_copy(c, buf, n, true);
+    pthread_mutex_unlock(&c->producer_lock);
+    console_wake(false);
+}
+
+// Kao perror, ali kroz konzolu gosta id.
+static void guest_perror(int id, const char *msg){
+    guest_printf(id, "%s: %s\n", msg, strerror(errno));
+}
+
+// Gost je zavrsio, ostatak njegovog bafera se ispisuje i bez '\n'.
+static void console_close(int id){
+    __atomic_store_n(&console.consoles[id].closed, true, __ATOMIC_RELEASE);
+    console_wake(false);
+}
+
+// Oslobadja prostor u baferima posle writev i budi goste koji cekaju.
+static void console_release(struct iovec *iov, uint64_t *new_tail, int *owner, int cnt){
+    for (int i = 0; i < cnt; i++){
+        if (owner[i] >= 0)
+            __atomic_store_n(&console.consoles[owner[i]].tail, new_tail[i], __ATOMIC_SEQ_CST);
+    }
+    for (int i = 0; i < cnt; i++){
+        if (owner[i] >= 0 && __atomic_exchange_n(&console.consoles[owner[i]].waiting, 0, __ATOMIC_SEQ_CST))
+            sem_post(&console.consoles[owner[i]].space);
+    }
+}
+
+static void console_writev_all(struct iovec *iov, int cnt){
+    while (cnt > 0){
+        ssize_t n = writev(STDOUT_FILENO, iov, cnt);
+        if (n < 0){
+            if (errno == EINTR) continue;
+            return;
+        }
+        while (cnt > 0 && (size_t)n >= iov->iov_len){
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0){
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+/*
+ * Jedan prolaz kroz sve bafere. Vraca true ako je nesto ispisano.
+ * Bafer gosta se oslobadja (tail) tek posle writev.
+ */
+static bool console_flush_all(bool final){
+    struct iovec iov[CONSOLE_IOV];
+    uint64_t new_tail[CONSOLE_IOV];
+    int owner[CONSOLE_IOV];
+    int cnt = 0;
+    bool wrote = false;
+    uint64_t now = now_ns();
+
+    for (int id = 0; id < console.count; id++){
+        struct guest_console *c = &console.consoles[id];
+        uint64_t head = __atomic_load_n(&c->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = c->tail;
+        uint64_t end = head;
+        bool closed = final || __atomic_load_n(&c->closed, __ATOMIC_ACQUIRE);
+
+        if (head == tail) continue;
+
+        // ispisujemo do poslednjeg '\n', osim ako red ne ceka predugo
+        while (end > tail && c->buf[(end - 1) & (console.size - 1)] != '\n') end--;
+        if (end == tail){
+            if (c->partial_since == 0) c->partial_since = now;
+            if (!closed && head - tail < console.size / 2 && now - c->partial_since < CONSOLE_PARTIAL_NS){
+                continue;
+            }
+            end = head;
+        }
+        c->partial_since = 0;
+
+        while (tail < end){
+            // za svaki segment trebaju najvise tri iovec-a (oznaka + dva dela bafera)
+            if (cnt + 3 > CONSOLE_IOV){
+                console_writev_all(iov, cnt);
+                console_release(iov, new_tail, owner, cnt);
+                cnt = 0;
+            }
+
+            uint64_t stop = tail;
+            while (stop < end && c->buf[stop & (console.size - 1)] != '\n') stop++;
+            if (stop < end) stop++; // '\n' ide uz svoj red
+
+            if (console.tagged && c->line_start){
+                iov[cnt].iov_base = c->tag;
+                iov[cnt].iov_len = c->tag_len;
+                owner[cnt++] = -1;
+            }
+
+            size_t pos = tail & (console.size - 1);
+            size_t len = stop - tail;
+            size_t first = console.size - pos;
+            if (first > len) first = len;
+            iov[cnt].iov_base = c->buf + pos;
+            iov[cnt].iov_len = first;
+            new_tail[cnt] = tail + first;
+            owner[cnt++] = id;
+            if (len > first){
+                iov[cnt].iov_base = c->buf;
+                iov[cnt].iov_len = len - first;
+                new_tail[cnt] = stop;
+                owner[cnt++] = id;
+            }
+
+            c->line_start = c->buf[(stop - 1) & (console.size - 1)] == '\n';
+            tail = stop;
+            wrote = true;
+        }
+    }
+
+    if (cnt > 0){
+        console_writev_all(iov, cnt);
+        console_release(iov, new_tail, owner, cnt);
+    }
+    return wrote;
+}
+
+static bool console_pending(void){
+    for (int id = 0; id < console.count; id++){
+        struct guest_console *c = &console.consoles[id];
+        if (__atomic_load_n(&c->head, __ATOMIC_ACQUIRE) != c->tail) return true;
+    }
+    return false;
+}
+
+static void* console_main(void* arg){
+    struct timespec ts;
+
+    while (!__atomic_load_n(&console.stop, __ATOMIC_ACQUIRE)){
+        if (console_flush_all(false)) continue;
+
+        // nema posla, proveravamo ponovo posle postavljanja idle da ne izgubimo budjenje
+        __atomic_store_n(&console.idle, 1, __ATOMIC_SEQ_CST);
+        if (console_pending()){
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += CONSOLE_IDLE_WAIT_NS;
+            if (ts.tv_nsec >= 1000000000){
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            sem_timedwait(&console.wake, &ts);
+        }
+        else{
+            sem_wait(&console.wake);
+        }
+    }
+    console_flush_all(true);
+    return NULL;
+}
+
+static int console_init(int num_guests){
+    // sve sto je host ispisao pre gostiju ide pre njihovog izlaza
+    fflush(stdout);
+    console.size = 4096;
+    while (console.size < opts.console_buffer) console.size *= 2;
+    console.count = num_guests;
+    console.tagged = num_guests > 1;
+    console.consoles = calloc(num_guests, sizeof(struct guest_console));
+    if (!console.consoles) return -1;
+    for (int i = 0; i < num_guests; i++){
+        struct guest_console *c = &console.consoles[i];
+        c->buf = malloc(console.size);
+        if (!c->buf) return -1;
+        pthread_mutex_init(&c->producer_lock, NULL);
+        sem_init(&c->space, 0, 0);
+        c->line_start = true;
+        c->tag_len = snprintf(c->tag, sizeof(c->tag), "[guest %d] ", i);
+    }
+    sem_init(&console.wake, 0, 0);
+    if (pthread_create(&console.thread, NULL, console_main, NULL) != 0){
+        printf("Failed to start the console thread\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Ispisuje sve sto je ostalo i zaustavlja nit za ispis.
+static void console_shutdown(void){
+    __atomic_store_n(&console.stop, true, __ATOMIC_RELEASE);
+    sem_post(&console.wake);
+    pthread_join(console.thread, NULL);
+    // poruke hosta posle zavrsetka gostiju (izvrsilac) idu iza izlaza gostiju
+    fflush(stdout);
+
+    for (int i = 0; i < console.count; i++){
+        struct guest_console *c = &console.consoles[i];
+        printf("Console guest %d: %lu bytes, %lu dropped, %lu waits on full buffer\n",
+               i, c->written, c->dropped, c->waits);
+    }
+    // nit za ispis vise ne radi, kasnije poruke idu direktno na stdout
+    __atomic_store_n(&console.count, 0, __ATOMIC_RELEASE);
+}
+
+// Da li je [addr, addr + len) unutar memorije gosta.
+static bool guest_range_ok(struct vm *vm, uint64_t addr, uint64_t len){
+    return addr <= vm->mem_size && len <= vm->mem_size - addr;
+}
+
+// Ispisuje sve sto je gost upisao u ring na adresi gpa i oslobadja ring.
+static int drain_console_ring(struct vm *vm, uint64_t gpa)
+{
+    struct console_ring *ring;
+    uint32_t head, tail, size, count, first;
+
+    // gpa dolazi od gosta, provere ne smeju da se prelivaju
+    if (!guest_range_ok(vm, gpa, sizeof(*ring))) {
+        guest_printf(vm->id, "Bad console ring address 0x%lx\n", gpa);
+        return -1;
+    }
+    ring = (struct console_ring *)(vm->mem + gpa);
+    size = __atomic_load_n(&ring->size, __ATOMIC_RELAXED);
+    if (size == 0 || !guest_range_ok(vm, gpa + sizeof(*ring), size)) {
+        guest_printf(vm->id, "Bad console ring size %u\n", size);
+        return -1;
+    }
+
+    // ring moze da prazni i vCPU nit i I/O nit
+    pthread_mutex_lock(&vm->console_lock);
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    tail = ring->tail;
+    count = head - tail;
+    if (count > size) {
+        pthread_mutex_unlock(&vm->console_lock);
+        guest_printf(vm->id, "Corrupted console ring (head %u, tail %u)\n", head, tail);
+        return -1;
+    }
+
+    // podaci mogu da budu u dva dela ako su presli kraj bafera
+    first = size - tail % size;
+    if (first > count) first = count;
+    console_write(vm->id, ring->data + tail % size, first);
+    console_write(vm->id, ring->data, count - first);
+
+    __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&vm->console_lock);
+    return 0;
+}
+
+// Ispisuje sve upise na konzolu koje je KVM skupio od poslednjeg izlaska.
+static void drain_coalesced(struct vm *vm)
+{
+    struct kvm_coalesced_mmio_ring *ring = vm->coalesced;
+    char buf[1024];
+    size_t n = 0;
+    uint32_t first;
+
+    if (!ring) {
+        return;
+    }
+    // prsten prazni vCPU koji je izasao, a prazan je cim jedan zavrsi
+    pthread_mutex_lock(&vm->console_lock);
+    first = ring->first;
+    while (first != __atomic_load_n(&ring->last, __ATOMIC_ACQUIRE)) {
+        struct kvm_coalesced_mmio *m = &ring->coalesced_mmio[first];
+        if (n + m->len > sizeof(buf)) {
+            console_write(vm->id, buf, n);
+            n = 0;
+        }
+        memcpy(buf + n, m->data, m->len);
+        n += m->len;
+        first = (first + 1) % vm->coalesced_max;
+    }
+    __atomic_store_n(&ring->first, first, __ATOMIC_RELEASE);
+    console_write(vm->id, buf, n);
+    pthread_mutex_unlock(&vm->console_lock);
+}
+
+// Bafer gosta ima jednog proizvodjaca, pa vCPU-i istog gosta upisuju jedan po jedan.
+static void vm_console_write(struct vm *vm, const char *data, size_t len)
+{
+    pthread_mutex_lock(&vm->console_lock);
+    console_write(vm->id, data, len);
+    pthread_mutex_unlock(&vm->console_lock);
+}
+
+static void setup_64bit_code_segment(struct kvm_sregs *sregs)
+{
+    struct kvm_segment seg = {
+            .base = 0,
+            .limit = 0xffffffff,
+            .present = 1, // Prisutan ili učitan u memoriji
+            .type = 11, // Code: execute, read, accessed
+            .dpl = 0, // Descriptor Privilage Level: 0 (0, 1, 2, 3)
+            .db = 0, // Default size - ima vrednost 0 u long modu
+            .s = 1, // Code/data tip segmenta
+            .l = 1, // Long mode - 1
+            .g = 1, // 4KB granularnost
+    };
+
+    sregs->cs = seg;
+
+    seg.type = 3; // Data: read, write, accessed
+    sregs->ds = sregs->es = sregs->fs = sregs->gs = sregs->ss = seg;
+}
+
+/*
+ * Tabele stranica ne zauzimaju RAM gosta. Za svaku kombinaciju velicine
+ * memorije i stranice prave se jednom, u memfd, i svaki gost ih mapira kao
+ * poseban memorijski slot samo za citanje na PT_BASE (iznad MMIO prozora).
+ * Redom: PML4, PDPT, PD za MMIO prozor, jedan PD po 1GB i (za 4KB stranice)
+ * jedan PT po 2MB. Sa 1GB stranicama PD treba samo za ostatak ispod 1GB.
+ * Bitovi A i D su vec postavljeni, pa procesor nikad ne upisuje u tabele.
+ */
+#define PAGE_1G 0x40000000
+#define PT_BASE 0xD00000000ULL
+#define PT_SLOT 1
+#define PDE64_TABLE (PDE64_PRESENT | PDE64_RW | PDE64_USER | PDE64_ACCESSED)
+#define PDE64_LEAF (PDE64_TABLE | PDE64_DIRTY)
+
+struct pt_template {
+    size_t mem_size;
+    size_t page_size;
+    size_t size;
+    int fd;
+    struct pt_template *next;
+};
+
+static struct pt_template *pt_templates;
+static pthread_mutex_t pt_templates_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t page_tables_size(size_t memSize, size_t pageSize)
+{
+    uint64_t pds = (memSize + (1UL << 30) - 1) >> 30;
+    uint64_t pts = pageSize == 0x1000 ? (memSize + 0x1FFFFF) >> 21 : 0;
+    if (pageSize == PAGE_1G) pds = memSize % PAGE_1G ? 1 : 0;
+    return (3 + pds + pts) * 0x1000;
+}
+
+/*
+ * 1GB stranice (PS u PDPT ulazu) postoje samo ako CPU ima pdpe1gb
+ * (CPUID 0x80000001, EDX bit 26). KVM proverava rezervisane bitove po
+ * CPUID-u gosta, pa gost mora da dobije podrzani CPUID preko KVM_SET_CPUID2.
+ */
+static bool setup_cpuid_1g(struct vm *vm)
+{
+    if (!host.pdpe1gb) {
+        return false;
+    }
+    for (int i = 0; i < vm->num_vcpus; i++) {
+        if (ioctl(vm->vcpus[i].fd, KVM_SET_CPUID2, host.cpuid) < 0) {
+            perror("KVM_SET_CPUID2");
+            return false;
+        }
+    }
+    return true;
+}
+
+// Popunjava tabele u tables, koje ce gost videti na adresi PT_BASE.
+static void build_page_tables(char *tables, size_t memSize, size_t pageSize)
+{
+    // Postavljanje 4 niva ugnjezdavanja.
+    // Svaka tabela stranica ima 512 ulaza, a svaki ulaz je veličine 8B.
+    // Odatle sledi da je veličina tabela stranica 4KB. Ove tabele moraju da budu poravnate na 4KB.
+    uint64_t page = 0;
+    uint64_t *pml4 = (void *)tables;
+
+    uint64_t pdpt_addr = PT_BASE + 0x1000;
+    uint64_t *pdpt = (void *)(tables + 0x1000);
+
+    uint64_t mmio_pd_addr = PT_BASE + 0x2000;
+    uint64_t *mmio_pd = (void *)(tables + 0x2000);
+
+    // PD tabele su jedna za drugom, svaka pokriva 1GB, a iza njih PT tabele
+    uint64_t pd_addr = PT_BASE + 0x3000;
+    uint64_t *pd = (void *)(tables + 0x3000);
+    size_t pds = (memSize + (1UL << 30) - 1) >> 30;
+
+    pml4[0] = PDE64_TABLE | pdpt_addr;
+    if (pageSize == PAGE_1G) {
+        // cele GB idu direktno u PDPT, ostatak preko jednog PD sa 2MB stranicama
+        size_t gbs = memSize / PAGE_1G;
+        for (size_t i = 0; i < gbs; i++) {
+            pdpt[i] = page | PDE64_LEAF | PDE64_PS;
+            page += PAGE_1G;
+        }
+        if (memSize % PAGE_1G) {
+            pdpt[gbs] = PDE64_TABLE | pd_addr;
+        }
+        pageSize = 2 * 1024 * 1024;
+        pds = 0;
+    }
+    for (size_t i = 0; i < pds; i++) {
+        pdpt[i] = PDE64_TABLE | (pd_addr + i * 0x1000);
+    }
+
+    // MMIO prozor je uvek mapiran jednom 2MB stranicom, VA == PA
+    pdpt[(MMIO_BASE >> 30) & 511] = PDE64_TABLE | mmio_pd_addr;
+    mmio_pd[(MMIO_BASE >> 21) & 511] = MMIO_BASE | PDE64_LEAF | PDE64_PS;
+
+    size_t pages = memSize / pageSize;
+
+    switch (pageSize) {
+        case 4 * 1024:
+            uint64_t pt_addr = pd_addr + pds * 0x1000;
+            uint64_t *pt = (void *)(tables + (pt_addr - PT_BASE));
+
+            // PT tabele su jedna za drugom od pt_addr, svaka pokriva 2MB
+            for (size_t i = 0; i < (pages + 511) / 512; i++) {
+                pd[i] = (pt_addr + i * 0x1000) | PDE64_TABLE;
+            }
+
+            for (size_t i = 0; i < pages; i++) {
+                pt[i] = page | PDE64_LEAF;
+                page += pageSize;
+            }
+            break;
+        case 2 * 1024 * 1024:
+            // sa 1GB stranicama PD pokriva samo ostatak posle celih GB
+            size_t first = page / pageSize;
+            for (size_t i = first; i < pages; i++) {
+                pd[i - first] = page | PDE64_LEAF | PDE64_PS;
+                page += pageSize;
+            }
+            break;
+    }
+}
+
+// Vraca sablon za datu konfiguraciju, pravi ga samo prvi gost koji ga trazi.
+static struct pt_template *get_page_tables(size_t memSize, size_t pageSize)
+{
+    struct pt_template *t;
+
+    pthread_mutex_lock(&pt_templates_lock);
+    for (t = pt_templates; t; t = t->next) {
+        if (t->mem_size == memSize && t->page_size == pageSize) {
+            pthread_mutex_unlock(&pt_templates_lock);
+            return t;
+        }
+    }
+
+    t = malloc(sizeof(*t));
+    t->mem_size = memSize;
+    t->page_size = pageSize;
+    t->size = page_tables_size(memSize, pageSize);
+    t->fd = memfd_create("page_tables", MFD_CLOEXEC);
+    if (t->fd < 0 || ftruncate(t->fd, t->size) < 0) {
+        perror("memfd page tables");
+        goto fail;
+    }
+
+    char *tables = mmap(NULL, t->size, PROT_READ | PROT_WRITE, MAP_SHARED, t->fd, 0);
+    if (tables == MAP_FAILED) {
+        perror("mmap page tables");
+        goto fail;
+    }
+    build_page_tables(tables, memSize, pageSize);
+    munmap(tables, t->size);
+
+    t->next = pt_templates;
+    pt_templates = t;
+    pthread_mutex_unlock(&pt_templates_lock);
+    return t;
+
+fail:
+    if (t->fd >= 0) close(t->fd);
+    free(t);
+    pthread_mutex_unlock(&pt_templates_lock);
+    return NULL;
+}
+
+/*
+ * Mapira sablon u slot PT_SLOT. Ako KVM ne podrzava slotove samo za
+ * citanje, svaki gost dobija svoju kopiju pri prvom upisu (MAP_PRIVATE).
+ */
+static int install_page_tables(struct vm *vm, struct pt_template *t)
+{
+    struct kvm_userspace_memory_region region;
+    bool readonly = host.readonly_mem;
+    void *tables;
+
+    if (readonly) {
+        tables = mmap(NULL, t->size, PROT_READ, MAP_SHARED, t->fd, 0);
+    } else {
+        tables = mmap(NULL, t->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, t->fd, 0);
+    }
+    if (tables == MAP_FAILED) {
+        perror("mmap page tables");
+        return -1;
+    }
+
+    region.slot = PT_SLOT;
+    region.flags = readonly ? KVM_MEM_READONLY : 0;
+    region.guest_phys_addr = PT_BASE;
+    region.memory_size = t->size;
+    region.userspace_addr = (unsigned long)tables;
+    if (ioctl(vm->vm_fd, KVM_SET_USER_MEMORY_REGION, &region) < 0) {
+        perror("KVM_SET_USER_MEMORY_REGION page tables");
+        munmap(tables, t->size);
+        return -1;
+    }
+    vm->pt_tables = tables;
+    vm->pt_size = t->size;
+    return 0;
+}
+
+// Omogucavanje long moda.
+// Vise od long modu mozete prociati o stranicenju u glavi 5:
+// https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24593.pdf
+// Pogledati figuru 5.1 na stranici 128.
+static int setup_long_mode(struct vm *vm, struct kvm_sregs *sregs, size_t memSize, size_t pageSize)
+{
+    struct pt_template *t = get_page_tables(memSize, pageSize);
+    if (t == NULL || install_page_tables(vm, t) < 0) {
+        return -1;
+    }
+
+    // Registar koji ukazuje na PML4 tabelu stranica. Odavde kreće mapiranje VA u PA.
+    sregs->cr3  = PT_BASE;
+    sregs->cr4  = CR4_PAE; // "Physical Address Extension" mora biti 1 za long mode.
+    sregs->cr0  = CR0_PE | CR0_PG; // Postavljanje "Protected Mode" i "Paging"
+    sregs->efer = EFER_LME | EFER_LMA; // Postavljanje  "Long Mode Active" i "Long Mode Enable"
+
+    // Inicijalizacija segmenata procesora.
+    setup_64bit_code_segment(sregs);
+    return 0;
+}
+
+void printUsage() {
+    printf("Usage: program_name [options]\n");
+    printf("Options:\n");
+    printf("  -m, --memory <size>    Set memory size, e.g. 8, 512M, 4G (plain number is MB)\n");
+    printf("  -p, --page <1G|2|4>    Set page size (1GB, 2MB or 4KB)\n");
+    printf("  -g, --guest <file.img> Specify guest image file\n");
+    printf("  -f, --file <file>      Files shared between guests\n");
+    printf("  --console-policy <block|drop>  What to do when a guest console buffer is full\n");
+    printf("  --console-buffer <KB>  Console buffer size per guest\n");
+    printf("  --no-coalesce          Exit on every console write instead of batching them in KVM\n");
+    printf("  --no-uring             Serve queued file requests with blocking calls instead of io_uring\n");
+    printf("  --hugepages [2M|1G]    Back guest memory with host huge pages (default 2M)\n");
+    printf("  --reclaim <dontneed|free>  How pages reported free by a guest are returned to the host\n");
+    printf("  --vcpus <N>            vCPUs per guest; vCPU i starts at rip 0 with its index in rdi\n");
+    printf("                         and its stack at the top of memory minus i * 64KB\n");
+    printf("  --workers <N>          Run guests on N worker threads instead of one thread per guest\n");
+    printf("  --quantum <ms>         Time slice of a guest on a worker (default 10)\n");
+    printf("  --warm-pool <N>        Create up to N VMs ahead (memory, vCPUs, page tables), sized from launch demand\n");
+    printf("  --pool <N>             Keep up to N guest memory regions for reuse, preallocated and reset on exit\n");
+    printf("  --numa <auto|N,N,...>  Bind each guest's memory and thread to a NUMA node (guest i gets the i-th node)\n");
+    printf("  --pin <compact|spread|N,N,...>  Pin each guest thread (or worker) to a CPU; compact fills\n");
+    printf("                         one package core by core, spread takes one core per package first,\n");
+    printf("                         a list gives vCPU thread i the i-th CPU\n");
+    printf("  --housekeeping <CPUs>  CPUs (e.g. 0,2-3) kept for console and I/O threads, not used by guests\n");
+    printf("  --ksm                  Let KSM merge identical guest pages, report merged pages per guest\n");
+    printf("  --ksm-scan <pages>     KSM pages_to_scan per wakeup\n");
+    printf("  --ksm-sleep <ms>       KSM sleep_millisecs between scans\n");
+    printf("  --ksm-zero-pages       Merge zero pages with the shared zero page (use_zero_pages)\n");
+    printf("  --snapshot <file>      Save guest state to file (guest N > 0 writes file.N)\n");
+    printf("  --snapshot-at <exit|hypercall>  Take the snapshot after the first exit or on a guest request\n");
+    printf("  A snapshot file can be passed to -g instead of an image to resume the guest\n");
+}
+
+/*
+ * Velicina memorije sa sufiksom K, M ili G, broj bez sufiksa je u MB.
+ */
+static bool parse_mem_size(const char* arg, size_t* size){
+    char* end;
+    unsigned long long n = strtoull(arg, &end, 10);
+    if (end == arg) return false;
+    switch (*end) {
+        case 'K': case 'k': n <<= 10; end++; break;
+        case 'G': case 'g': n <<= 30; end++; break;
+        case 'M': case 'm': end++; // fallthrough
+        case '\0': n <<= 20; break;
+        default: return false;
+    }
+    if (*end != '\0') return false;
+    *size = n;
+    return true;
+}
+
+bool check_arguments(int argc, char* argv[],char*** img, size_t* mem_size, int* page_size,int* num_guests,char*** shared_files, int* num_shared){
+
+    for (int i = 1; i < argc; i++) {
+
+        if (strcmp(argv[i], "--memory") == 0 || strcmp(argv[i], "-m") == 0) {
+            if (i + 1 < argc) {
+                if (!parse_mem_size(argv[i + 1], mem_size)) {
+                    printf("Error: Invalid memory size '%s'.\n", argv[i + 1]);
+                    return false;
+                }
+                i++; // Skip the next argument
+            } else {
+                printf("Error: Missing memory size argument.\n");
+                printUsage();
+                return false;
+            }
+        } else if (strcmp(argv[i], "--page") == 0 || strcmp(argv[i], "-p") == 0) {
+            if (i + 1 < argc) {
+                // 1G se pamti kao 1, 2 je 2MB, 4 je 4KB
+                *page_size = strcmp(argv[i + 1], "1G") == 0 ? 1 : atoi(argv[i + 1]);
+                i++; // Skip the next argument
+            } else {
+                printf("Error: Missing page size argument.\n");
+                printUsage();
+                return false;
+            }
+        } else if (strcmp(argv[i], "--guest") == 0 || strcmp(argv[i], "-g") == 0) {
+            int c =0;
+            if (argc - (i+1) == 0){
                 printf("bad args\n");
                 return false;
             }
-            //*num_guests = argc - (i+1);
-            if (img!=NULL){
-                *img = (char**)malloc(((argc-(i+1))*sizeof(char*)));
-                if (*img == NULL) {
-                    printf("BAD ALLOC");
-                    return false;
-                }
+            //*num_guests = argc - (i+1);
+            if (img!=NULL){
+                *img = (char**)malloc(((argc-(i+1))*sizeof(char*)));
+                if (*img == NULL) {
+                    printf("BAD ALLOC");
+                    return false;
+                }
+            }
+            else return false;
+            while (i + 1 < argc && argv[i+1][0] != '-') {
+                (*img)[c] = (char*) malloc(255*sizeof(char));
+                if ((*img)[c]!=NULL){
+                    strcpy((*img)[c],argv[i+1]);
+                }
+                c++;
+                i++;
+            }
+            *num_guests = c;
+            if (i+1<argc && c == 0){
+                printf("Error: Missing guest image file argument.\n");
+                printUsage();
+                return false;
+            }
+
+
+        }
+        else if(strcmp(argv[i], "--file") == 0 || strcmp(argv[i], "-f") == 0){
+            int f = 0;
+            if (shared_files != NULL){
+                *shared_files = (char**)malloc(((argc-(i+1))*sizeof(char*)));
+                if (*shared_files == NULL) {
+                    printf("BAD ALLOC");
+                    return false;
+                }
+            }
+            else return false;
+            while (i + 1 < argc && argv[i+1][0] != '-') {
+                (*shared_files)[f] = (char*) malloc(255*sizeof(char));
+                if ((*shared_files)[f]!=NULL){
+                    strcpy((*shared_files)[f],argv[i+1]);
+                }
+                f++;
+                i++;
+            }
+            *num_shared = f;
+            if (i+1<argc && f == 0){
+                printf("Error\n");
+                printUsage();
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--console-policy") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "block") == 0) {
+                opts.console_policy = CONSOLE_BLOCK;
+            } else if (strcmp(argv[i], "drop") == 0) {
+                opts.console_policy = CONSOLE_DROP;
+            } else {
+                printf("Error: Console policy must be block or drop.\n");
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--no-coalesce") == 0) {
+            opts.coalesce = false;
+        }
+        else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc) {
+            opts.snapshot = argv[++i];
+        }
+        else if (strcmp(argv[i], "--snapshot-at") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "exit") == 0) {
+                opts.snapshot_at = SNAPSHOT_AT_EXIT;
+            } else if (strcmp(argv[i], "hypercall") == 0) {
+                opts.snapshot_at = SNAPSHOT_AT_HYPERCALL;
+            } else {
+                printf("Error: Snapshot point must be exit or hypercall.\n");
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--no-uring") == 0) {
+            opts.uring = false;
+        }
+        else if (strcmp(argv[i], "--reclaim") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "dontneed") == 0) {
+                opts.reclaim = RECLAIM_DONTNEED;
+            } else if (strcmp(argv[i], "free") == 0) {
+                opts.reclaim = RECLAIM_FREE;
+            } else {
+                printf("Error: Reclaim mode must be dontneed or free.\n");
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            opts.workers = atoi(argv[++i]);
+            if (opts.workers < 0) {
+                printf("Error: Invalid number of workers.\n");
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--vcpus") == 0 && i + 1 < argc) {
+            opts.vcpus = atoi(argv[++i]);
+            if (opts.vcpus < 1 || opts.vcpus > MAX_VCPUS) {
+                printf("Error: Number of vCPUs must be between 1 and %d.\n", MAX_VCPUS);
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--quantum") == 0 && i + 1 < argc) {
+            opts.quantum_ms = atoi(argv[++i]);
+            if (opts.quantum_ms <= 0) {
+                printf("Error: Invalid quantum.\n");
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--warm-pool") == 0 && i + 1 < argc) {
+            opts.warm_pool = atoi(argv[++i]);
+            if (opts.warm_pool < 0 || opts.warm_pool > MAX_WARM_VMS) {
+                printf("Error: Warm pool size must be between 0 and %d.\n", MAX_WARM_VMS);
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--pool") == 0 && i + 1 < argc) {
+            opts.pool = atoi(argv[++i]);
+            if (opts.pool < 0) {
+                printf("Error: Invalid pool size.\n");
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--numa") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "auto") == 0) {
+                opts.numa = NUMA_AUTO;
+            } else {
+                char *p = argv[i];
+                opts.numa = NUMA_MANUAL;
+                opts.numa_count = 0;
+                while (*p && opts.numa_count < 64) {
+                    char *end;
+                    opts.numa_list[opts.numa_count++] = strtol(p, &end, 10);
+                    if (end == p || (*end != ',' && *end != '\0')) {
+                        printf("Error: NUMA placement must be auto or a list of nodes.\n");
+                        return false;
+                    }
+                    p = *end ? end + 1 : end;
+                }
+            }
+        }
+        else if (strcmp(argv[i], "--pin") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "compact") == 0) {
+                opts.pin = PIN_COMPACT;
+            } else if (strcmp(argv[i], "spread") == 0) {
+                opts.pin = PIN_SPREAD;
+            } else {
+                char *p = argv[i];
+                opts.pin = PIN_LIST;
+                opts.pin_count = 0;
+                while (*p && opts.pin_count < 64) {
+                    char *end;
+                    opts.pin_list[opts.pin_count++] = strtol(p, &end, 10);
+                    if (end == p || (*end != ',' && *end != '\0')) {
+                        printf("Error: Pinning must be compact, spread or a list of CPUs.\n");
+                        return false;
+                    }
+                    p = *end ? end + 1 : end;
+                }
+            }
+        }
+        else if (strcmp(argv[i], "--housekeeping") == 0 && i + 1 < argc) {
+            i++;
+            CPU_ZERO(&opts.housekeeping);
+            parse_range_list(argv[i], set_cpu, &opts.housekeeping);
+            if (CPU_COUNT(&opts.housekeeping) == 0) {
+                printf("Error: Housekeeping CPUs must be a list like 0,2-3.\n");
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--ksm") == 0) {
+            opts.ksm = true;
+        }
+        else if (strcmp(argv[i], "--ksm-scan") == 0 && i + 1 < argc) {
+            opts.ksm_scan = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--ksm-sleep") == 0 && i + 1 < argc) {
+            opts.ksm_sleep = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--ksm-zero-pages") == 0) {
+            opts.ksm_zero_pages = true;
+        }
+        else if (strcmp(argv[i], "--hugepages") == 0) {
+            opts.hugepages = HUGE_2M;
+            if (i + 1 < argc && strcmp(argv[i+1], "1G") == 0) {
+                opts.hugepages = HUGE_1G;
+                i++;
+            } else if (i + 1 < argc && strcmp(argv[i+1], "2M") == 0) {
+                i++;
+            }
+        }
+        else if (strcmp(argv[i], "--console-buffer") == 0 && i + 1 < argc) {
+            i++;
+            if (atoi(argv[i]) <= 0) {
+                printf("Error: Invalid console buffer size.\n");
+                return false;
+            }
+            opts.console_buffer = (size_t)atoi(argv[i]) * 1024;
+        }
+        else {
+            printf("Error: Unknown option '%s'.\n", argv[i]);
+            printUsage();
+            return false;
+        }
+    }
+
+    // Validate arguments
+    if (*page_size != 1 && *page_size != 2 && *page_size != 4) {
+        printf("Error: Invalid page size. Choose 1G, 2 or 4.\n");
+        return false;
+    }
+    // memorija mora biti ispod MMIO prozora i deljiva velicinom stranice
+    // 1GB stranice mogu da se kombinuju sa 2MB, pa je dovoljno 2MB poravnanje
+    size_t align = *page_size == 4 ? 0x1000 : 0x200000;
+    if (*mem_size < 0x200000 || *mem_size > MMIO_BASE || *mem_size % align != 0) {
+        printf("Error: Invalid memory size. Use 2M to %lluG in multiples of the page size.\n",
+               MMIO_BASE >> 30);
+        return false;
+    }
+    if (img == NULL) {
+        printf("Error: Guest image file not specified.\n");
+        return false;
+    }
+
+    if (opts.snapshot && opts.vcpus > 1) {
+        printf("Error: Snapshots are supported only for guests with one vCPU.\n");
+        return false;
+    }
+
+    if (opts.hugepages && *page_size == 4) {
+        printf("Note: guest uses 4KB pages, use -p 2 to get large pages in both translation levels.\n");
+    }
+
+    // Print parsed values
+
+    // Your logic for handling the arguments goes here
+
+    return true;
+}
+
+
+
+
+/*
+ * Slika gosta se ucitava samo jednom, u memfd. Svaki gost mapira taj fajl
+ * MAP_PRIVATE na pocetak svoje memorije, pa gosti sa istom slikom dele
+ * stranice koda dok neko od njih ne upise u njih (copy-on-write).
+ */
+struct image_template{
+    char* file_name;
+    int fd;
+    size_t size;
+    size_t mapped_size; // size zaokruzen na stranicu
+    char* data; // mapiranje samo za citanje, za kopiranje kada ne moze MAP_FIXED
+};
+
+static struct image_template* load_image(char* file_name){
+    FILE* img = fopen(file_name, "r");
+    if (img == NULL) {
+        return NULL;
+    }
+
+    struct image_template* t = malloc(sizeof(struct image_template));
+    t->file_name = file_name;
+    t->size = 0;
+    t->fd = memfd_create(file_name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (t->fd < 0) {
+        perror("memfd_create");
+        fclose(img);
+        free(t);
+        return NULL;
+    }
+
+    char buf[4096];
+    size_t r;
+    while((r = fread(buf, 1, sizeof(buf), img)) > 0) {
+        if (write(t->fd, buf, r) != (ssize_t)r) {
+            perror("write image");
+            fclose(img);
+            close(t->fd);
+            free(t);
+            return NULL;
+        }
+        t->size += r;
+    }
+    fclose(img);
+
+    long page = sysconf(_SC_PAGESIZE);
+    t->mapped_size = (t->size + page - 1) & ~(page - 1);
+    if (t->mapped_size == 0) t->mapped_size = page;
+    ftruncate(t->fd, t->mapped_size);
+    // niko vise ne sme da menja sablon
+    fcntl(t->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+
+    t->data = mmap(NULL, t->mapped_size, PROT_READ, MAP_SHARED, t->fd, 0);
+    if (t->data == MAP_FAILED) {
+        perror("mmap image");
+        close(t->fd);
+        free(t);
+        return NULL;
+    }
+    return t;
+}
+
+// Ista slika se deli izmedju gostiju, trazi se po imenu fajla.
+static struct image_template* find_image(struct image_template** images, int num_images, char* file_name){
+    for (int i = 0; i < num_images; i++){
+        if (images[i] && strcmp(images[i]->file_name, file_name) == 0) return images[i];
+    }
+    return NULL;
+}
+
+static void free_image(struct image_template* t){
+    munmap(t->data, t->mapped_size);
+    close(t->fd);
+    free(t);
+}
+
+/*
+ * Postavlja sliku na pocetak memorije gosta. Sa hugepages memorija ne sme
+ * da se parca, pa se slika kopira iz sablona umesto da se mapira.
+ */
+static int map_image(struct vm* vm, struct image_template* t, size_t limit){
+    if (t->mapped_size > limit) {
+        printf("Guest image %s does not fit in guest memory\n", t->file_name);
+        return -1;
+    }
+    if (vm->mem_huge) {
+        memcpy(vm->mem, t->data, t->size);
+        return 0;
+    }
+    if (mmap(vm->mem, t->mapped_size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_FIXED, t->fd, 0) == MAP_FAILED) {
+        perror("mmap image template");
+        return -1;
+    }
+    vm->file_mapped = t->mapped_size;
+    return 0;
+}
+
+struct guest_args{
+    size_t mem_size;
+    int page_size;
+    char* file_name;
+    struct image_template* image;
+    bool snapshot; // file_name je snimak stanja, a ne slika
+    char** shared_files;
+    int num_shared;
+    int id;
+};
+sem_t mutex;
+
+typedef struct OpenFiles{
+    FILE* file; // NULL dok ga stari protokol ne zatrazi (fajl otvoren preko io_uring)
+    int fd;
+    int handle;
+    char name[255];
+    bool copied;
+    char mode[3];
+}OpenFiles;
+
+
+char* generateNewName(char* name,char id){
+    char* ret = malloc(255);
+    strcpy(ret,name);
+
+    bool flag = false;
+    char carry;
+    char temp;
+    int i=0;
+    while(ret[i]!='.')i++;
+    int index = i;
+    temp = ret[i];
+
+    while(ret[i+1]!='\0'){
+        carry = ret[i+1];
+        ret[i+1] = temp;
+        temp = carry;
+        i++;
+    }
+    ret[i+1] = temp;
+    ret[i+2] = '\0';
+    ret[index] = id;
+
+    return ret;
+    //strcat(name,&carry);
+}
+#define MAX_OPEN_FILES 64
+
+/*
+ * Stanje protokola za fajlove na FILE_PORT.
+ * Gost salje komandu, ime, mod/velicinu i podatke bajt po bajt (ili vise
+ * bajtova odjednom preko rep outsb), pa stanje mora da se cuva izmedju
+ * izlazaka iz gosta. Svaki vCPU ima svoje, da se komande dva vCPU-a ne mesaju.
+ */
+struct file_port {
+    bool opening_file;
+    bool closing_file;
+    bool writing;
+    bool reading;
+    int read_size;
+
+    bool getting_name;
+    bool getting_mode;
+    bool getting_size;
+
+    char mode[3];
+    char name[255];
+    char size[255];
+    int index;
+    FILE* current_file;
+    int current_handle; // fajl u koji stari protokol trenutno upisuje
+};
+
+// Fajlovi jednog gosta, zajednicki za sve njegove vCPU-e.
+struct file_state {
+    struct file_port port[MAX_VCPUS];
+
+    /*
+     * Tabela otvorenih fajlova, handle je indeks u files.
+     * Slobodni indeksi se cuvaju na steku free_handles.
+     */
+    OpenFiles *files[MAX_OPEN_FILES];
+    int free_handles[MAX_OPEN_FILES];
+    int num_free;
+    // lista fajlova se koristi i iz vCPU niti i iz I/O niti
+    pthread_mutex_t lock;
+
+    int id;
+    char** shared_files;
+    int num_shared;
+};
+
+static bool writable_mode(char* mode){
+    return strcmp(mode,"w") == 0 || strcmp(mode,"w+") == 0 || strcmp(mode,"r+") == 0 ||
+           strcmp(mode,"a") == 0 ||strcmp(mode,"a+") == 0;
+}
+
+static bool is_shared_file(struct file_state *fs, char* name){
+    for (int i=0;i<fs->num_shared;i++){
+        if (strcmp(name,fs->shared_files[i])==0) return true;
+    }
+    return false;
+}
+
+static void file_state_init(struct file_state *fs, int id, char** shared_files, int num_shared){
+    memset(fs, 0, sizeof(*fs));
+    fs->id = id;
+    fs->shared_files = shared_files;
+    fs->num_shared = num_shared;
+    for (int i = 0; i < MAX_VCPUS; i++){
+        fs->port[i].current_handle = -1;
+    }
+    // najmanji handle se dodeljuje prvi
+    for (int i = 0; i < MAX_OPEN_FILES; i++){
+        fs->free_handles[i] = MAX_OPEN_FILES - 1 - i;
+    }
+    fs->num_free = MAX_OPEN_FILES;
+    pthread_mutex_init(&fs->lock, NULL);
+}
+
+// Zauzima handle za fajl, NULL ako je tabela puna.
+static OpenFiles* new_open_file(struct file_state *fs, FILE* file, int fd, char* name, char* mode){
+    if (fs->num_free == 0){
+        return NULL;
+    }
+    OpenFiles *temp = malloc(sizeof(OpenFiles));
+    temp->file = file;
+    temp->fd = fd;
+    temp->handle = fs->free_handles[--fs->num_free];
+    strcpy(temp->name,name);
+    temp->copied = false;
+    strcpy(temp->mode,mode);
+    fs->files[temp->handle] = temp;
+    return temp;
+}
+
+// Dodaje fajl u listu otvorenih, deljeni fajlovi koji se menjaju dobijaju kopiju.
+static OpenFiles* add_open_file(struct file_state *fs, FILE* file, char* name, char* mode){
+    OpenFiles *temp = new_open_file(fs, file, fileno(file), name, mode);
+    if (!temp){
+        guest_printf(fs->id, "Too many open files\n");
+        fclose(file);
+        return NULL;
+    }
+
+    if (writable_mode(mode) && is_shared_file(fs, temp->name)){
+        //moramo da napravimo nov fajl
+        guest_printf(fs->id, "pravimo novi fajl\n");
+        char t = (char)(fs->id+48);
+        char* h = temp->name;
+        fclose(temp->file);
+        temp->copied = true;
+        char* new_name = generateNewName(h,t);
+
+        temp->file = fopen(new_name,temp->mode);
+        if (!temp->file){
+            temp->file = fopen(new_name,"w");
+            fclose(temp->file);
+            temp->file = fopen(new_name,temp->mode);
+        }
+        temp->fd = fileno(temp->file);
+        guest_printf(fs->id, "%s\n",new_name);
+        free(new_name);
+    }
+    return temp;
+}
+
+// Stari protokol radi sa FILE*, pravi ga za fajlove otvorene samo kao fd.
+static FILE* open_file_stream(OpenFiles *file){
+    if (!file->file){
+        file->file = fdopen(file->fd, file->mode);
+    }
+    return file->file;
+}
+
+// Trazenje po imenu treba samo starom protokolu, jednom po komandi.
+static OpenFiles* find_open_file(struct file_state *fs, char* name){
+    for (int i = 0; i < MAX_OPEN_FILES; i++){
+        if (fs->files[i] && strcmp(fs->files[i]->name,name)==0) return fs->files[i];
+    }
+    return NULL;
+}
+
+static OpenFiles* find_open_handle(struct file_state *fs, int handle){
+    if (handle < 0 || handle >= MAX_OPEN_FILES) return NULL;
+    return fs->files[handle];
+}
+
+// Oslobadja handle, ali ne zatvara fajl.
+static void unlink_open_file(struct file_state *fs, OpenFiles *file){
+    if (fs->files[file->handle] != file) return;
+    fs->files[file->handle] = NULL;
+    fs->free_handles[fs->num_free++] = file->handle;
+    for (int i = 0; i < MAX_VCPUS; i++){
+        if (fs->port[i].current_handle == file->handle) fs->port[i].current_handle = -1;
+    }
+}
+
+static void release_open_file(struct file_state *fs, OpenFiles *file){
+    if (file->file){
+        fclose(file->file);
+    }
+    else{
+        close(file->fd);
+    }
+    guest_printf(fs->id, "Successfully closed file %s\n",file->name);
+    free(file);
+}
+
+// Izbacuje fajl iz liste otvorenih i zatvara ga.
+static void close_open_file(struct file_state *fs, OpenFiles *file){
+    unlink_open_file(fs, file);
+    release_open_file(fs, file);
+}
+
+// Gost je zavrsio, zatvaraju se fajlovi koje nije sam zatvorio.
+static void file_state_release(struct file_state *fs){
+    for (int i = 0; i < MAX_OPEN_FILES; i++){
+        if (fs->files[i]) close_open_file(fs, fs->files[i]);
+    }
+    pthread_mutex_destroy(&fs->lock);
+}
+
+// Dodaje jedan bajt u ime/mod/velicinu, vraca true kada stigne '\0'.
+static bool collect_char(struct file_port *p, char* buf, int buf_size, char input){
+    if (p->index < buf_size - 1 || input == '\0'){
+        buf[p->index] = input;
+        p->index++;
+    }
+    if (input == '\0'){
+        p->index = 0;
+        return true;
+    }
+    return false;
+}
+
+/*
+ * fopen, fclose, upis u fajl - obrada jednog bajta koji je gost poslao na FILE_PORT
+ * Vraca -1 ako gost trazi nesto nedozvoljeno.
+ */
+static int file_port_out(struct file_state *fs, int cpu, char input){
+    struct file_port *p = &fs->port[cpu];
+
+    switch(input){
+        case 0x01:
+            //signal za pocetak fopen
+            p->opening_file = true;
+            p->getting_name = true;
+            p->index = 0;
+            return 0;
+        case 0x02:
+            //signal za pocetak fclose
+            p->closing_file = true;
+            p->getting_name = true;
+            p->index = 0;
+            return 0;
+        case 0x03:
+            //signal za pocetak read
+            p->reading = true;
+            p->getting_name = true;
+            p->index = 0;
+            return 0;
+        case 0x04:
+            //signal za pocetak write
+            p->writing = true;
+            p->getting_name = true;
+            p->index = 0;
+            return 0;
+    }
+
+    //samo citamo karaktere, na osnovu flegova odlucujemo sta je
+    if (p->opening_file && p->getting_name){
+        if (collect_char(p, p->name, sizeof(p->name), input)){
+            //imamo name, sada flegovi
+            p->getting_name = false;
+            p->getting_mode = true;
+        }
+    }
+    else if (p->opening_file && p->getting_mode){
+        if (collect_char(p, p->mode, sizeof(p->mode), input)){
+            p->getting_mode = false;
+            p->opening_file = false;
+            //otvaramo fajl
+            p->current_file = fopen(p->name,p->mode);
+            if (!p->current_file){
+                guest_printf(fs->id, "COULDNT OPEN FILE %s , in mode %s\n",p->name,p->mode);
+                return -1;
+            }
+            guest_printf(fs->id, "opened file %s in mode %s\n",p->name,p->mode);
+            //dodaj u tabelu otvorenih
+            if (!add_open_file(fs, p->current_file, p->name, p->mode)){
+                return -1;
+            }
+
+            guest_printf(fs->id, "Open files: ");
+            for (int i = 0; i < MAX_OPEN_FILES; i++){
+                if (fs->files[i]) guest_printf(fs->id, "%s ",fs->files[i]->name);
+            }
+            guest_printf(fs->id, "\n");
+        }
+    }
+    else if (p->closing_file && p->getting_name){
+        if (collect_char(p, p->name, sizeof(p->name), input)){
+            p->getting_name = false;
+            p->closing_file = false;
+            //nadji fajl koji zatvaramo u listi otvorenih
+            OpenFiles *temp = find_open_file(fs, p->name);
+            if (!temp){
+                guest_printf(fs->id, "ERROR, attempted close on non-open file\n");
+                return -1;
+            }
+            close_open_file(fs, temp);
+        }
+    }
+    else if (p->reading && p->getting_name){
+        if (collect_char(p, p->name, sizeof(p->name), input)){
+            guest_printf(fs->id, "reading from %s ... \n",p->name);
+            p->getting_name = false;
+            p->getting_size = true;
+            OpenFiles *temp = find_open_file(fs, p->name);
+            if (!temp){
+                guest_printf(fs->id, "ERROR, can't read from non-open file\n");
+                return -1;
+            }
+            p->current_file = open_file_stream(temp);
+        }
+    }
+    else if (p->reading && p->getting_size){
+        if (collect_char(p, p->size, sizeof(p->size), input)){
+            guest_printf(fs->id, "reading %s characters from %s ... \n",p->size,p->name);
+            p->getting_size = false;
+            p->read_size = atoi(p->size);
+            fseek(p->current_file,0,0);
+        }
+    }
+    else if (p->writing && p->getting_name){
+        if (collect_char(p, p->name, sizeof(p->name), input)){
+            p->getting_name = false;
+            //fajl se trazi jednom, a ne za svaki bajt
+            OpenFiles* temp = find_open_file(fs, p->name);
+            if (!temp) {
+                guest_printf(fs->id, "ERROR, cant write to non-open file\n");
+                return -1;
+            }
+            p->current_handle = temp->handle;
+        }
+    }
+    else if (p->writing){
+        if (input == '\0'){
+            p->writing = false;
+            return 0;
+        }
+        OpenFiles* temp = find_open_handle(fs, p->current_handle);
+        if (!temp) {
+            guest_printf(fs->id, "ERROR, cant write to non-open file\n");
+            return -1;
+        }
+
+        fwrite(&input,1,1,open_file_stream(temp));
+    }
+    return 0;
+}
+
+// citanje iz fajla - sledeci bajt koji gost dobija sa FILE_PORT
+static char file_port_in(struct file_state *fs, int cpu){
+    struct file_port *p = &fs->port[cpu];
+    char c;
+
+    if (!p->reading){
+        return '\0';
+    }
+
+    c = fgetc(p->current_file);
+    if (feof(p->current_file)){
+        p->reading = false;
+        c = '\0';
+    }
+
+    if (ferror(p->current_file))guest_printf(fs->id, "error...\n");
+    p->read_size--;
+    if (p->read_size == 0) p->reading = false;
+    return c;
+}
+
+/*
+ * Izvrsava zahtev iz opisnog protokola (struct file_request na adresi gpa).
+ * Greske u samom zahtevu se vracaju gostu kroz result, -1 se vraca samo ako
+ * adresa zahteva nije u memoriji gosta.
+ */
+static int file_request_locked(struct vm *vm, struct file_state *fs, uint64_t gpa){
+    struct file_request *req, r;
+    OpenFiles *file = NULL;
+    FILE* f;
+    char name[255];
+    char mode[4];
+    ssize_t n;
+
+    if (!guest_range_ok(vm, gpa, sizeof(struct file_request))){
+        guest_printf(fs->id, "Bad file request address 0x%lx\n", gpa);
+        return -1;
+    }
+    req = (struct file_request *)(vm->mem + gpa);
+    // gost moze da menja zahtev dok ga host obradjuje, pa se cita samo jednom
+    memcpy(&r, req, sizeof(r));
+
+    if (r.opcode != FILE_OP_OPEN){
+        file = find_open_handle(fs, r.handle);
+        if (!file){
+            req->result = -EBADF;
+            return 0;
+        }
+    }
+    if (r.opcode != FILE_OP_CLOSE && !guest_range_ok(vm, r.addr, r.len)){
+        req->result = -EFAULT;
+        return 0;
+    }
+
+    switch(r.opcode){
+        case FILE_OP_OPEN:
+            if (r.len == 0 || r.len >= sizeof(name)){
+                req->result = -ENAMETOOLONG;
+                return 0;
+            }
+            memcpy(name, vm->mem + r.addr, r.len);
+            name[r.len] = '\0';
+            memcpy(mode, r.mode, sizeof(mode));
+            mode[sizeof(mode) - 1] = '\0';
+            if (strlen(mode) > 2){
+                req->result = -EINVAL;
+                return 0;
+            }
+
+            f = fopen(name, mode);
+            if (!f){
+                req->result = -errno;
+                return 0;
+            }
+            guest_printf(fs->id, "opened file %s in mode %s\n",name,mode);
+            file = add_open_file(fs, f, name, mode);
+            req->result = file ? file->handle : -EMFILE;
+            break;
+        case FILE_OP_CLOSE:
+            close_open_file(fs, file);
+            req->result = 0;
+            break;
+        case FILE_OP_READ:
+            //stdio bafer mora da se isprazni pre direktnog citanja
+            if (file->file) fflush(file->file);
+            n = pread(file->fd, vm->mem + r.addr, r.len, r.offset);
+            req->result = n < 0 ? -errno : n;
+            break;
+        case FILE_OP_WRITE:
+            if (file->file) fflush(file->file);
+            n = pwrite(file->fd, vm->mem + r.addr, r.len, r.offset);
+            req->result = n < 0 ? -errno : n;
+            break;
+        default:
+            req->result = -EINVAL;
+            break;
+    }
+    return 0;
+}
+
+static int file_request(struct vm *vm, struct file_state *fs, uint64_t gpa){
+    struct file_request *req;
+    int ret;
+
+    pthread_mutex_lock(&fs->lock);
+    ret = file_request_locked(vm, fs, gpa);
+    pthread_mutex_unlock(&fs->lock);
+    if (ret == 0){
+        req = (struct file_request *)(vm->mem + gpa);
+        __atomic_store_n(&req->status, FILE_REQ_DONE, __ATOMIC_RELEASE);
+    }
+    return ret;
+}
+
+/*
+ * Minimalni io_uring bez liburing: jedan prsten po VM, koristi ga samo I/O nit.
+ * Zahtevi iz asinhronog reda gosta se salju kao OPENAT/READ/WRITE/CLOSE, a
+ * rezultat se upisuje gostu kada stigne CQE. Zavrsetak se javlja na eventfd
+ * (IORING_REGISTER_EVENTFD), pa I/O nit ceka i na kick i na zavrsetke.
+ */
+#define URING_ENTRIES 64
+
+struct uring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned to_submit;
+    void *sq_ptr;
+    size_t sq_len;
+    size_t sqes_len;
+};
+
+static int uring_init(struct uring *r, unsigned entries){
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0){
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)){
+        close(r->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    // SQ i CQ dele isto mapiranje
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    if (p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe) > r->sq_len)
+        r->sq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED){
+        close(r->fd);
+        return -1;
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED){
+        munmap(r->sq_ptr, r->sq_len);
+        close(r->fd);
+        return -1;
+    }
+
+    r->sq_head = (unsigned *)((char *)r->sq_ptr + p.sq_off.head);
+    r->sq_tail = (unsigned *)((char *)r->sq_ptr + p.sq_off.tail);
+    r->sq_mask = (unsigned *)((char *)r->sq_ptr + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)((char *)r->sq_ptr + p.sq_off.array);
+    r->cq_head = (unsigned *)((char *)r->sq_ptr + p.cq_off.head);
+    r->cq_tail = (unsigned *)((char *)r->sq_ptr + p.cq_off.tail);
+    r->cq_mask = (unsigned *)((char *)r->sq_ptr + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)r->sq_ptr + p.cq_off.cqes);
+    r->to_submit = 0;
+    return 0;
+}
+
+static void uring_destroy(struct uring *r){
+    munmap(r->sqes, r->sqes_len);
+    munmap(r->sq_ptr, r->sq_len);
+    close(r->fd);
+}
+
+// Salje kernelu sve pripremljene SQE, a ako wait nije 0 i ceka toliko zavrsetaka.
+static int uring_enter(struct uring *r, unsigned wait){
+    int ret;
+
+    do {
+        ret = syscall(__NR_io_uring_enter, r->fd, r->to_submit, wait,
+                      wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret >= 0){
+        r->to_submit -= ret;
+    }
+    return ret;
+}
+
+// Sledeci slobodan SQE; ako je prsten pun, prvo se salje sve sto ceka.
+static struct io_uring_sqe* uring_get_sqe(struct uring *r){
+    unsigned tail = *r->sq_tail;
+    unsigned index;
+
+    if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) == *r->sq_mask + 1){
+        if (uring_enter(r, 0) < 0){
+            return NULL;
+        }
+        if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) == *r->sq_mask + 1){
+            return NULL;
+        }
+    }
+    index = tail & *r->sq_mask;
+    r->sq_array[index] = index;
+    memset(&r->sqes[index], 0, sizeof(struct io_uring_sqe));
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->to_submit++;
+    return &r->sqes[index];
+}
+
+// Jedan zahtev gosta koji ceka na io_uring.
+struct uring_op {
+    uint64_t gpa;
+    uint32_t opcode;
+    OpenFiles *file; // za close
+    char name[255]; // za open
+    char path[256]; // ime koje se stvarno otvara (kopija za deljene fajlove)
+    char mode[4];
+    bool copied;
+};
+
+/*
+ * I/O nit jedne VM. Ceka na ioeventfd (kick) i obradjuje sve sto je gost
+ * stavio u asinhroni red, dok vCPU nit nastavlja sa izvrsavanjem gosta.
+ */
+struct io_worker {
+    struct vm *vm;
+    struct file_state *fs;
+    pthread_t thread;
+    bool running;
+    int kick_fd;
+    int stop_fd;
+    bool ioeventfd; // false ako KVM ne podrzava ioeventfd, kick tada ide preko izlaska
+    uint64_t queue_gpa;
+    // zahtevi iz reda idu preko io_uring ako je dostupan
+    bool uring;
+    struct uring ring;
+    int cq_fd;
+    unsigned inflight;
+};
+
+// open(2) flegovi za mod iz fopen-a, -1 za nepoznat mod
+static int open_flags(char* mode){
+    if (strcmp(mode,"r") == 0) return O_RDONLY;
+    if (strcmp(mode,"r+") == 0) return O_RDWR;
+    if (strcmp(mode,"w") == 0) return O_WRONLY | O_CREAT | O_TRUNC;
+    if (strcmp(mode,"w+") == 0) return O_RDWR | O_CREAT | O_TRUNC;
+    if (strcmp(mode,"a") == 0) return O_WRONLY | O_CREAT | O_APPEND;
+    if (strcmp(mode,"a+") == 0) return O_RDWR | O_CREAT | O_APPEND;
+    return -1;
+}
+
+static void complete_request(struct vm *vm, uint64_t gpa, int64_t result){
+    struct file_request *req = (struct file_request *)(vm->mem + gpa);
+    req->result = result;
+    __atomic_store_n(&req->status, FILE_REQ_DONE, __ATOMIC_RELEASE);
+}
+
+/*
+ * Salje zahtev sa adrese gpa na io_uring, bez cekanja na rezultat.
+ * Ako io_uring nije dostupan zahtev se odmah izvrsava sinhrono.
+ * Vraca -1 samo ako adresa zahteva nije u memoriji gosta.
+ */
+static int io_worker_submit(struct io_worker *w, uint64_t gpa){
+    struct vm *vm = w->vm;
+    struct file_state *fs = w->fs;
+    struct file_request r;
+    struct io_uring_sqe *sqe = NULL;
+    struct uring_op *op;
+    OpenFiles *file;
+    char *new_name;
+    int flags, fd;
+
+    if (!w->uring){
+        return file_request(vm, fs, gpa);
+    }
+
+    if (!guest_range_ok(vm, gpa, sizeof(struct file_request))){
+        guest_printf(fs->id, "Bad file request address 0x%lx\n", gpa);
+        return -1;
+    }
+    // zahtev se kopira jednom, SQE se pravi samo iz kopije
+    memcpy(&r, vm->mem + gpa, sizeof(r));
+    if (r.opcode != FILE_OP_CLOSE && !guest_range_ok(vm, r.addr, r.len)){
+        complete_request(vm, gpa, -EFAULT);
+        return 0;
+    }
+
+    op = calloc(1, sizeof(struct uring_op));
+    op->gpa = gpa;
+    op->opcode = r.opcode;
+
+    switch(r.opcode){
+        case FILE_OP_OPEN:
+            memcpy(op->mode, r.mode, sizeof(op->mode));
+            op->mode[sizeof(op->mode) - 1] = '\0';
+            flags = open_flags(op->mode);
+            if (r.len == 0 || r.len >= sizeof(op->name) || flags < 0){
+                complete_request(vm, gpa, flags < 0 ? -EINVAL : -ENAMETOOLONG);
+                free(op);
+                return 0;
+            }
+            memcpy(op->name, vm->mem + r.addr, r.len);
+            op->name[r.len] = '\0';
+            strcpy(op->path, op->name);
+            if (writable_mode(op->mode) && is_shared_file(fs, op->name)){
+                //deljeni fajl, gost dobija svoju kopiju
+                new_name = generateNewName(op->name, (char)(fs->id+48));
+                strcpy(op->path, new_name);
+                free(new_name);
+                flags |= O_CREAT;
+                op->copied = true;
+            }
+            sqe = uring_get_sqe(&w->ring);
+            if (sqe){
+                sqe->opcode = IORING_OP_OPENAT;
+                sqe->fd = AT_FDCWD;
+                sqe->addr = (uintptr_t)op->path;
+                sqe->len = 0644;
+                sqe->open_flags = flags | O_CLOEXEC;
+            }
+            break;
+        case FILE_OP_READ:
+        case FILE_OP_WRITE:
+            pthread_mutex_lock(&fs->lock);
+            file = find_open_handle(fs, r.handle);
+            fd = file ? file->fd : -1;
+            if (file && file->file) fflush(file->file);
+            pthread_mutex_unlock(&fs->lock);
+            if (fd < 0){
+                complete_request(vm, gpa, -EBADF);
+                free(op);
+                return 0;
+            }
+            sqe = uring_get_sqe(&w->ring);
+            if (sqe){
+                sqe->opcode = r.opcode == FILE_OP_READ ? IORING_OP_READ : IORING_OP_WRITE;
+                sqe->fd = fd;
+                sqe->addr = (uintptr_t)(vm->mem + r.addr);
+                sqe->len = r.len > (1U << 30) ? (1U << 30) : r.len;
+                sqe->off = r.offset;
+            }
+            break;
+        case FILE_OP_CLOSE:
+            pthread_mutex_lock(&fs->lock);
+            file = find_open_handle(fs, r.handle);
+            if (file) unlink_open_file(fs, file);
+            pthread_mutex_unlock(&fs->lock);
+            if (!file || file->file){
+                //FILE* mora da se zatvori preko fclose zbog bafera
+                if (file) release_open_file(fs, file);
+                complete_request(vm, gpa, file ? 0 : -EBADF);
+                free(op);
+                return 0;
             }
-            else return false;
-            while (i + 1 < argc && strcmp("--file",argv[i+1])!=0 && strcmp("-f",argv[i+1])!=0) {
-                (*img)[c] = (char*) malloc(255*sizeof(char));
-                if ((*img)[c]!=NULL){
-                    strcpy((*img)[c],argv[i+1]);
-                }
-                c++;
-                i++;
+            op->file = file;
+            sqe = uring_get_sqe(&w->ring);
+            if (sqe){
+                sqe->opcode = IORING_OP_CLOSE;
+                sqe->fd = file->fd;
             }
-            *num_guests = c;
-            if (i+1<argc && c == 0){
-                printf("Error: Missing guest image file argument.\n");
-                printUsage();
-                return false;
+            break;
+        default:
+            complete_request(vm, gpa, -EINVAL);
+            free(op);
+            return 0;
+    }
+
+    if (!sqe){
+        // handle je vec izbacen iz tabele, pa se close zavrsava odmah i uspeva
+        if (op->file) release_open_file(fs, op->file);
+        complete_request(vm, gpa, op->file ? 0 : -EAGAIN);
+        free(op);
+        return 0;
+    }
+    sqe->user_data = (uintptr_t)op;
+    w->inflight++;
+    return 0;
+}
+
+// Upisuje gostu rezultate svih zavrsenih io_uring operacija.
+static void io_worker_reap(struct io_worker *w){
+    struct uring *r = &w->ring;
+    unsigned head = *r->cq_head;
+    OpenFiles *file;
+
+    while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)){
+        struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        struct uring_op *op = (struct uring_op *)(uintptr_t)cqe->user_data;
+        int64_t result = cqe->res;
+
+        if (op->opcode == FILE_OP_OPEN && cqe->res >= 0){
+            pthread_mutex_lock(&w->fs->lock);
+            file = new_open_file(w->fs, NULL, cqe->res, op->name, op->mode);
+            if (file){
+                file->copied = op->copied;
+                result = file->handle;
+            }
+            pthread_mutex_unlock(&w->fs->lock);
+            if (file){
+                guest_printf(w->fs->id, "opened file %s in mode %s\n", op->path, op->mode);
+            }
+            else{
+                close(cqe->res);
+                result = -EMFILE;
             }
+        }
+        else if (op->opcode == FILE_OP_CLOSE){
+            guest_printf(w->fs->id, "Successfully closed file %s\n", op->file->name);
+            free(op->file);
+        }
+        complete_request(w->vm, op->gpa, result);
+        free(op);
+        w->inflight--;
+        head++;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+
+// Obradjuje sve zahteve izmedju tail i head. Vraca -1 ako je red neispravan.
+static int io_worker_drain(struct io_worker *w){
+    struct io_queue *q;
+    uint32_t head, tail, size;
+    uint64_t ring;
+
+    if (!guest_range_ok(w->vm, w->queue_gpa, sizeof(struct io_queue))){
+        return -1;
+    }
+    q = (struct io_queue *)(w->vm->mem + w->queue_gpa);
+    size = q->size;
+    if (size == 0 || !guest_range_ok(w->vm, w->queue_gpa + sizeof(struct io_queue), (uint64_t)size * 8)){
+        return -1;
+    }
 
+    ring = q->console_ring;
+    if (ring != 0 && drain_console_ring(w->vm, ring) < 0){
+        return -1;
+    }
 
+    head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    tail = q->tail;
+    if (head - tail > size){
+        guest_printf(w->fs->id, "Corrupted I/O queue (head %u, tail %u)\n", head, tail);
+        return -1;
+    }
+    while (tail != head){
+        if (io_worker_submit(w, q->requests[tail % size]) < 0){
+            return -1;
         }
-        else if(strcmp(argv[i], "--file") == 0 || strcmp(argv[i], "-f") == 0){
-            int f = 0;
-            if (shared_files != NULL){
-                *shared_files = (char**)malloc(((argc-(i+1))*sizeof(char*)));
-                if (*shared_files == NULL) {
-                    printf("BAD ALLOC");
-                    return false;
-                }
+        tail++;
+        __atomic_store_n(&q->tail, tail, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+static void* io_worker_main(void* arg){
+    struct io_worker *w = arg;
+    struct pollfd fds[3];
+    uint64_t cnt;
+    bool stop = false;
+
+    pin_helper();
+    fds[0].fd = w->kick_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = w->stop_fd;
+    fds[1].events = POLLIN;
+    fds[2].fd = w->uring ? w->cq_fd : -1;
+    fds[2].events = POLLIN;
+
+    while (!stop){
+        if (poll(fds, 3, -1) < 0){
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+        if (fds[0].revents & POLLIN){
+            read(w->kick_fd, &cnt, sizeof(cnt));
+        }
+        if (fds[2].revents & POLLIN){
+            read(w->cq_fd, &cnt, sizeof(cnt));
+        }
+        if (fds[1].revents & POLLIN){
+            //posle gasenja jos jednom praznimo red
+            stop = true;
+        }
+        if (w->uring){
+            io_worker_reap(w);
+        }
+        if (io_worker_drain(w) < 0){
+            guest_printf(w->fs->id, "Bad I/O queue at 0x%lx, async I/O stopped\n", w->queue_gpa);
+            break;
+        }
+        if (w->uring && w->ring.to_submit > 0 && uring_enter(&w->ring, 0) < 0){
+            perror("io_uring_enter");
+        }
+    }
+
+    // cekamo sve sto je jos kod kernela, memorija gosta mora da ostane ziva do tada
+    while (w->uring && w->inflight > 0){
+        if (uring_enter(&w->ring, 1) < 0){
+            perror("io_uring_enter");
+            break;
+        }
+        io_worker_reap(w);
+    }
+    return NULL;
+}
+
+/*
+ * Registruje red na adresi gpa i pokrece I/O nit. Doorbell port se vezuje
+ * za eventfd preko KVM_IOEVENTFD, tako da outb na IO_KICK_PORT ne izlazi iz gosta.
+ */
+static int io_worker_start(struct io_worker *w, uint64_t gpa){
+    struct kvm_ioeventfd ioev;
+
+    if (w->running){
+        //nova adresa reda, nit vec radi
+        w->queue_gpa = gpa;
+        return 0;
+    }
+
+    w->queue_gpa = gpa;
+    w->kick_fd = eventfd(0, EFD_CLOEXEC);
+    w->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (w->kick_fd < 0 || w->stop_fd < 0){
+        perror("eventfd");
+        return -1;
+    }
+
+    memset(&ioev, 0, sizeof(ioev));
+    ioev.addr = IO_KICK_PORT;
+    ioev.len = 1;
+    ioev.fd = w->kick_fd;
+    ioev.flags = KVM_IOEVENTFD_FLAG_PIO;
+    w->ioeventfd = host.ioeventfd &&
+                   ioctl(w->vm->vm_fd, KVM_IOEVENTFD, &ioev) == 0;
+    if (!w->ioeventfd){
+        guest_printf(w->fs->id, "KVM_IOEVENTFD not available, I/O kicks will exit to the hypervisor\n");
+    }
+
+    w->uring = false;
+    if (opts.uring){
+        if (uring_init(&w->ring, URING_ENTRIES) < 0){
+            perror("io_uring_setup, async file requests run synchronously");
+        }
+        else{
+            w->cq_fd = eventfd(0, EFD_CLOEXEC);
+            if (w->cq_fd >= 0 &&
+                syscall(__NR_io_uring_register, w->ring.fd, IORING_REGISTER_EVENTFD, &w->cq_fd, 1) == 0){
+                w->uring = true;
             }
-            else return false;
-            while (i + 1 < argc) {
-                (*shared_files)[f] = (char*) malloc(255*sizeof(char));
-                if ((*shared_files)[f]!=NULL){
-                    strcpy((*shared_files)[f],argv[i+1]);
-                }
-                f++;
-                i++;
+            else{
+                perror("IORING_REGISTER_EVENTFD");
+                if (w->cq_fd >= 0) close(w->cq_fd);
+                uring_destroy(&w->ring);
             }
-            *num_shared = f;
-            if (i+1<argc && f == 0){
-                printf("Error\n");
-                printUsage();
-                return false;
+        }
+    }
+
+    if (pthread_create(&w->thread, NULL, io_worker_main, w) != 0){
+        printf("Failed to start the I/O thread\n");
+        return -1;
+    }
+    w->running = true;
+    return 0;
+}
+
+static void io_worker_kick(struct io_worker *w){
+    uint64_t one = 1;
+    if (w->running){
+        write(w->kick_fd, &one, sizeof(one));
+    }
+}
+
+// Zaustavlja I/O nit kada gost stane, sve sto je ostalo u redu se obradi.
+static void io_worker_stop(struct io_worker *w){
+    uint64_t one = 1;
+
+    if (!w->running){
+        return;
+    }
+    write(w->stop_fd, &one, sizeof(one));
+    pthread_join(w->thread, NULL);
+    close(w->kick_fd);
+    close(w->stop_fd);
+    if (w->uring){
+        uring_destroy(&w->ring);
+        close(w->cq_fd);
+    }
+    w->running = false;
+}
+
+/*
+ * Obrada pristupa MMIO prozoru. Vraca -1 ako gost treba da se zaustavi.
+ */
+/*
+ * Snimak stanja gosta: registri, sregs, FPU/XSAVE, XCR, MSR-ovi i cela
+ * memorija. Memorija je na kraju fajla, poravnata na stranicu, pa se pri
+ * vracanju mapira direktno iz fajla (MAP_PRIVATE) i ucitava tek kada je gost
+ * dotakne. Stranice sa samim nulama se ne upisuju (rupe u fajlu).
+ * Stanje na strani hosta (otvoreni fajlovi, registrovan asinhroni red)
+ * nije deo snimka, pa snimak treba praviti pre toga. Snimak ima samo jedan
+ * vCPU, pa se ne pravi za goste sa --vcpus vecim od 1.
+ */
+#define SNAPSHOT_MAGIC "KVMSNAP1"
+#define SNAPSHOT_ALIGN 0x1000
+
+static const uint32_t snapshot_msrs[] = {
+    0x10,       // IA32_TSC
+    0x174,      // IA32_SYSENTER_CS
+    0x175,      // IA32_SYSENTER_ESP
+    0x176,      // IA32_SYSENTER_EIP
+    0x1a0,      // IA32_MISC_ENABLE
+    0x277,      // IA32_PAT
+    0xc0000081, // STAR
+    0xc0000082, // LSTAR
+    0xc0000083, // CSTAR
+    0xc0000084, // SYSCALL_MASK
+    0xc0000102, // KERNEL_GS_BASE
+};
+#define SNAPSHOT_NMSRS (sizeof(snapshot_msrs) / sizeof(snapshot_msrs[0]))
+
+struct snapshot_header {
+    char magic[8];
+    uint64_t mem_size;
+    uint64_t page_size;
+    uint64_t mem_offset;
+    uint32_t has_xsave;
+    uint32_t has_xcrs;
+    uint32_t nmsrs;
+    uint32_t reserved;
+    struct kvm_regs regs;
+    struct kvm_sregs sregs;
+    struct kvm_fpu fpu;
+    struct kvm_xsave xsave;
+    struct kvm_xcrs xcrs;
+    struct kvm_msr_entry msrs[SNAPSHOT_NMSRS];
+};
+
+static bool is_snapshot(char* file_name){
+    char magic[8];
+    int fd = open(file_name, O_RDONLY);
+    if (fd < 0) return false;
+    bool ok = read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+              memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) == 0;
+    close(fd);
+    return ok;
+}
+
+static int read_snapshot_header(char* file_name, struct snapshot_header* h){
+    int fd = open(file_name, O_RDONLY);
+    if (fd < 0) {
+        perror("open snapshot");
+        return -1;
+    }
+    if (pread(fd, h, sizeof(*h), 0) != sizeof(*h)) {
+        printf("Snapshot %s is truncated\n", file_name);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    // zaglavlje dolazi iz fajla, pa vaze ista pravila kao za -m i -p
+    size_t align = h->page_size == 0x1000 ? 0x1000 : 0x200000;
+    if (h->nmsrs > SNAPSHOT_NMSRS ||
+        (h->page_size != 0x1000 && h->page_size != 0x200000 && h->page_size != PAGE_1G) ||
+        h->mem_size < 0x200000 || h->mem_size > MMIO_BASE || h->mem_size % align != 0 ||
+        h->mem_offset < sizeof(*h) || h->mem_offset % SNAPSHOT_ALIGN != 0) {
+        printf("Snapshot %s has an invalid header\n", file_name);
+        return -1;
+    }
+    return 0;
+}
+
+static bool page_is_zero(const char* p){
+    for (size_t i = 0; i < SNAPSHOT_ALIGN; i += sizeof(uint64_t)) {
+        if (*(const uint64_t*)(p + i)) return false;
+    }
+    return true;
+}
+
+// Cuva stanje vCPU-a i memoriju. Prekinuti I/O mora prvo da se zavrsi.
+static int save_snapshot(struct vm* vm, size_t page_size){
+    char path[300];
+    struct snapshot_header* h;
+    struct {
+        struct kvm_msrs hdr;
+        struct kvm_msr_entry entries[SNAPSHOT_NMSRS];
+    } msrs;
+    struct vcpu *cpu = &vm->vcpus[0];
+    int ret = -1;
+
+    if (vm->id == 0) snprintf(path, sizeof(path), "%s", opts.snapshot);
+    else snprintf(path, sizeof(path), "%s.%d", opts.snapshot, vm->id);
+
+    // KVM zavrsava zapoceti IN/OUT/MMIO tek u sledecem KVM_RUN
+    cpu->run->immediate_exit = 1;
+    ioctl(cpu->fd, KVM_RUN, 0);
+    cpu->run->immediate_exit = 0;
+
+    h = calloc(1, sizeof(*h));
+    memcpy(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic));
+    h->mem_size = vm->mem_size;
+    h->page_size = page_size;
+    h->mem_offset = (sizeof(*h) + SNAPSHOT_ALIGN - 1) & ~(uint64_t)(SNAPSHOT_ALIGN - 1);
+
+    if (ioctl(cpu->fd, KVM_GET_REGS, &h->regs) < 0 ||
+        ioctl(cpu->fd, KVM_GET_SREGS, &h->sregs) < 0 ||
+        ioctl(cpu->fd, KVM_GET_FPU, &h->fpu) < 0) {
+        guest_perror(vm->id, "snapshot vcpu state");
+        goto out;
+    }
+    if (host.xsave) {
+        h->has_xsave = ioctl(cpu->fd, KVM_GET_XSAVE, &h->xsave) == 0;
+    }
+    if (host.xcrs) {
+        h->has_xcrs = ioctl(cpu->fd, KVM_GET_XCRS, &h->xcrs) == 0;
+    }
+
+    memset(&msrs, 0, sizeof(msrs));
+    msrs.hdr.nmsrs = SNAPSHOT_NMSRS;
+    for (size_t i = 0; i < SNAPSHOT_NMSRS; i++) {
+        msrs.entries[i].index = snapshot_msrs[i];
+    }
+    // vraca broj procitanih, staje na prvom koji ne postoji
+    int n = ioctl(cpu->fd, KVM_GET_MSRS, &msrs);
+    h->nmsrs = n > 0 ? n : 0;
+    memcpy(h->msrs, msrs.entries, h->nmsrs * sizeof(struct kvm_msr_entry));
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        guest_perror(vm->id, "open snapshot");
+        goto out;
+    }
+    if (pwrite(fd, h, sizeof(*h), 0) != sizeof(*h) ||
+        ftruncate(fd, h->mem_offset + vm->mem_size) < 0) {
+        guest_perror(vm->id, "write snapshot");
+        close(fd);
+        goto out;
+    }
+    for (size_t off = 0; off < vm->mem_size; off += SNAPSHOT_ALIGN) {
+        if (page_is_zero(vm->mem + off)) continue;
+        if (pwrite(fd, vm->mem + off, SNAPSHOT_ALIGN, h->mem_offset + off) != SNAPSHOT_ALIGN) {
+            guest_perror(vm->id, "write snapshot");
+            close(fd);
+            goto out;
+        }
+    }
+    close(fd);
+    guest_printf(vm->id, "Saved snapshot of guest %d to %s\n", vm->id, path);
+    ret = 0;
+
+out:
+    free(h);
+    return ret;
+}
+
+// Vraca memoriju i stanje vCPU-a iz snimka, tabele stranica su vec postavljene.
+static int restore_snapshot(struct vm* vm, char* file_name, struct snapshot_header* h){
+    struct vcpu *cpu = &vm->vcpus[0];
+    struct {
+        struct kvm_msrs hdr;
+        struct kvm_msr_entry entries[SNAPSHOT_NMSRS];
+    } msrs;
+
+    struct stat st;
+
+    int fd = open(file_name, O_RDONLY);
+    if (fd < 0) {
+        perror("open snapshot");
+        return -1;
+    }
+    // memorija mora cela da postoji u fajlu, inace bi gost dobio SIGBUS
+    if (fstat(fd, &st) < 0 || (uint64_t)st.st_size < h->mem_offset ||
+        (uint64_t)st.st_size - h->mem_offset < h->mem_size) {
+        printf("Snapshot %s is truncated\n", file_name);
+        close(fd);
+        return -1;
+    }
+    // hugepages mapiranje ne sme da se parca, pa se memorija tada kopira
+    if (vm->mem_huge) {
+        for (size_t off = 0; off < h->mem_size; ) {
+            ssize_t r = pread(fd, vm->mem + off, h->mem_size - off, h->mem_offset + off);
+            if (r <= 0) {
+                perror("read snapshot");
+                close(fd);
+                return -1;
             }
+            off += r;
         }
-        else {
-            printf("Error: Unknown option '%s'.\n", argv[i]);
-            printUsage();
-            return false;
+    }
+    else if (mmap(vm->mem, h->mem_size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_FIXED, fd, h->mem_offset) == MAP_FAILED) {
+        perror("mmap snapshot");
+        close(fd);
+        return -1;
+    }
+    else {
+        vm->file_mapped = h->mem_size;
+    }
+    close(fd);
+
+    if (ioctl(cpu->fd, KVM_SET_SREGS, &h->sregs) < 0 ||
+        ioctl(cpu->fd, KVM_SET_REGS, &h->regs) < 0 ||
+        ioctl(cpu->fd, KVM_SET_FPU, &h->fpu) < 0) {
+        perror("restore vcpu state");
+        return -1;
+    }
+    if (h->has_xcrs && ioctl(cpu->fd, KVM_SET_XCRS, &h->xcrs) < 0) {
+        perror("KVM_SET_XCRS");
+        return -1;
+    }
+    if (h->has_xsave && ioctl(cpu->fd, KVM_SET_XSAVE, &h->xsave) < 0) {
+        perror("KVM_SET_XSAVE");
+        return -1;
+    }
+
+    memset(&msrs, 0, sizeof(msrs));
+    msrs.hdr.nmsrs = h->nmsrs;
+    memcpy(msrs.entries, h->msrs, h->nmsrs * sizeof(struct kvm_msr_entry));
+    if (ioctl(cpu->fd, KVM_SET_MSRS, &msrs) != (int)h->nmsrs) {
+        printf("Failed to restore guest MSRs\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Odbacuje prijavljene slobodne opsege iz memorije gosta.
+static int free_pages(struct vm *vm, uint64_t gpa){
+    struct free_page_report *report;
+    // poravnanje prema stvarnoj memoriji, hugepages alokacija moze da padne na THP ili 4KB
+    size_t align = vm->mem_page;
+    uint64_t reclaimed = 0, report_start, report_end;
+    uint32_t count;
+
+    if (!guest_range_ok(vm, gpa, sizeof(*report))) {
+        guest_printf(vm->id, "Bad free page report address 0x%lx\n", gpa);
+        return 0;
+    }
+    report = (void *)(vm->mem + gpa);
+    // gost moze da menja izvestaj u toku obrade, broj i opsezi se citaju jednom
+    count = __atomic_load_n(&report->count, __ATOMIC_RELAXED);
+    if (!guest_range_ok(vm, gpa + sizeof(*report), (uint64_t)count * sizeof(struct free_range))) {
+        guest_printf(vm->id, "Bad free page report size %u\n", count);
+        return 0;
+    }
+    report_start = gpa & ~(uint64_t)(align - 1);
+    report_end = gpa + sizeof(*report) + (uint64_t)count * sizeof(struct free_range);
+
+    for (uint32_t i = 0; i < count; i++) {
+        struct free_range r;
+        memcpy(&r, &report->ranges[i], sizeof(r));
+        if (!guest_range_ok(vm, r.addr, r.len)) continue;
+
+        // samo cele stranice, i nikad stranica u kojoj je sam izvestaj
+        uint64_t start = (r.addr + align - 1) & ~(uint64_t)(align - 1);
+        uint64_t end = (r.addr + r.len) & ~(uint64_t)(align - 1);
+        if (start < report_end && end > report_start) continue;
+        if (start >= end) continue;
+
+        // MADV_FREE radi samo nad anonimnom memorijom, za sliku ostaje DONTNEED
+        if (opts.reclaim == RECLAIM_FREE && madvise(vm->mem + start, end - start, MADV_FREE) == 0) {
+            reclaimed += end - start;
+            continue;
+        }
+        if (madvise(vm->mem + start, end - start, MADV_DONTNEED) < 0) {
+            guest_perror(vm->id, "madvise free pages");
+            continue;
+        }
+        reclaimed += end - start;
+    }
+
+    report->reclaimed = reclaimed;
+    // vise vCPU-a moze da prijavljuje u isto vreme
+    __atomic_fetch_add(&vm->reclaimed_bytes, reclaimed, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&vm->free_reports, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static int mmio_access(struct vm *vm, struct file_state *fs, struct kvm_run *run, int cpu){
+    uint64_t offset = run->mmio.phys_addr - MMIO_BASE;
+    uint64_t value = 0;
+    struct timespec ts;
+    int data;
+
+    if (run->mmio.len > 8){
+        return -1;
+    }
+
+    if (run->mmio.is_write){
+        memcpy(&value, run->mmio.data, run->mmio.len);
+        switch(offset){
+            case MMIO_CONSOLE_DATA:
+                vm_console_write(vm, (char *)run->mmio.data, run->mmio.len);
+                return 0;
+            case MMIO_CONSOLE_RING:
+                return drain_console_ring(vm, value);
+            case MMIO_FILE_REQUEST:
+                return file_request(vm, fs, value);
+            case MMIO_SNAPSHOT:
+                vm->snapshot_requested = true;
+                return 0;
+            case MMIO_FREE_PAGES:
+                return free_pages(vm, value);
+        }
+    }
+    else{
+        switch(offset){
+            case MMIO_CONSOLE_IN:
+                guest_printf(vm->id, "input: \n");
+                scanf("%d", &data);
+                value = (int64_t)data;
+                break;
+            case MMIO_TIME_NS:
+                clock_gettime(CLOCK_MONOTONIC, &ts);
+                value = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+                break;
+            case MMIO_CPU_ID:
+                value = cpu;
+                break;
+            case MMIO_NUM_CPUS:
+                value = vm->num_vcpus;
+                break;
+            default:
+                value = 0;
+                break;
+        }
+        memcpy(run->mmio.data, &value, run->mmio.len);
+        return 0;
+    }
+
+    guest_printf(vm->id, "Unhandled MMIO %s at 0x%llx (len %u)\n", run->mmio.is_write ? "write" : "read",
+           run->mmio.phys_addr, run->mmio.len);
+    return 0;
+}
+
+/*
+ * VM spremna za gosta: memorija, vCPU-i i tabele stranica, svi vCPU-i u
+ * long modu. Gostu ostaje samo da mapira sliku i postavi registre, pa ovo
+ * moze da se uradi unapred (--warm-pool). page_size se menja ako 1GB
+ * stranice nisu podrzane.
+ */
+static int vm_prepare(struct vm *vm, size_t mem_size, int *page_size, int num_vcpus){
+    struct kvm_sregs sregs;
+
+    if (init_vm(vm, mem_size, num_vcpus)) {
+        guest_printf(vm->id, "Failed to init the VM\n");
+        return -1;
+    }
+
+    if (*page_size == PAGE_1G && !setup_cpuid_1g(vm)) {
+        guest_printf(vm->id, "1GB pages are not supported by this CPU, using 2MB pages\n");
+        *page_size = 0x200000;
+    }
+
+    if (ioctl(vm->vcpus[0].fd, KVM_GET_SREGS, &sregs) < 0) {
+        guest_perror(vm->id, "KVM_GET_SREGS");
+        return -1;
+    }
+
+    if (setup_long_mode(vm, &sregs, mem_size, *page_size) < 0) {
+        guest_printf(vm->id, "Failed to set up page tables\n");
+        return -1;
+    }
+
+    // svi vCPU-i krecu iz istog stanja
+    for (int i = 0; i < num_vcpus; i++) {
+        if (ioctl(vm->vcpus[i].fd, KVM_SET_SREGS, &sregs) < 0) {
+            guest_perror(vm->id, "KVM_SET_SREGS");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Topli pool VM-ova (--warm-pool N). Posebna nit unapred pravi VM-ove sa
+ * velicinom memorije, stranica i brojem vCPU-a iz komandne linije, pa
+ * gost samo uzme gotovu VM. Ciljna velicina prati potraznju: broj
+ * uzimanja po intervalu od WARM_INTERVAL_MS se usrednjava (EWMA), a pool
+ * drzi dvostruko vise, najvise N. Visak se gasi jedan po intervalu, da
+ * pool ne osciluje. VM koja je vec izvrsavala gosta se ne vraca u pool.
+ */
+#define WARM_INTERVAL_MS 100
+#define WARM_HEADROOM 2
+
+struct warm_vm {
+    struct vm vm;
+    int page_size;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t thread;
+    bool running;
+    bool stop;
+    struct warm_vm *vms[MAX_WARM_VMS];
+    int count;
+    int target;
+    size_t mem_size;
+    int page_size;
+    int takes; // uzimanja u tekucem intervalu
+    double demand; // usrednjen broj uzimanja po intervalu
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t created;
+    uint64_t trimmed;
+    struct lat_hist hit_lat; // od pocetka guest_setup do prvog KVM_RUN
+    struct lat_hist miss_lat;
+} warm = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+};
+
+static struct warm_vm *warm_create(void){
+    struct warm_vm *w = calloc(1, sizeof(*w));
+
+    w->page_size = warm.page_size;
+    // gost jos nije poznat, poruke idu na stdout (warm_take postavlja id)
+    w->vm.id = -1;
+    if (vm_prepare(&w->vm, warm.mem_size, &w->page_size, opts.vcpus) < 0) {
+        destroy_vm(&w->vm);
+        free(w);
+        return NULL;
+    }
+    return w;
+}
+
+static void warm_destroy(struct warm_vm *w){
+    destroy_vm(&w->vm);
+    free(w);
+}
+
+// Novi cilj iz potraznje u poslednjem intervalu.
+static void warm_resize(void){
+    warm.demand = 0.5 * warm.demand + 0.5 * warm.takes;
+    warm.takes = 0;
+    warm.target = (int)(warm.demand * WARM_HEADROOM + 0.999);
+    if (warm.target < 1) warm.target = 1;
+    if (warm.target > opts.warm_pool) warm.target = opts.warm_pool;
+}
+
+static void *warm_main(void *arg){
+    uint64_t next = now_ns() + WARM_INTERVAL_MS * 1000000ULL;
+    struct timespec deadline;
+
+    pin_helper();
+    pthread_mutex_lock(&warm.lock);
+    while (!warm.stop) {
+        if (warm.count < warm.target) {
+            // VM se pravi bez zakljucavanja, gosti za to vreme uzimaju postojece
+            pthread_mutex_unlock(&warm.lock);
+            struct warm_vm *w = warm_create();
+            pthread_mutex_lock(&warm.lock);
+            if (w == NULL) {
+                warm.target = warm.count;
+            } else {
+                warm.vms[warm.count++] = w;
+                warm.created++;
+            }
+            continue;
         }
+
+        if (now_ns() >= next) {
+            warm_resize();
+            next = now_ns() + WARM_INTERVAL_MS * 1000000ULL;
+            if (warm.count > warm.target) {
+                struct warm_vm *w = warm.vms[--warm.count];
+                warm.trimmed++;
+                pthread_mutex_unlock(&warm.lock);
+                warm_destroy(w);
+                pthread_mutex_lock(&warm.lock);
+            }
+            continue;
+        }
+        deadline.tv_sec = next / 1000000000ULL;
+        deadline.tv_nsec = next % 1000000000ULL;
+        pthread_cond_timedwait(&warm.wake, &warm.lock, &deadline);
     }
+    pthread_mutex_unlock(&warm.lock);
+    return NULL;
+}
 
-    // Validate arguments
-    if (*mem_size != 2 && *mem_size  != 4 && *mem_size  != 8) {
-        printf("Error: Invalid memory size. Choose 2, 4, or 8 GB.\n");
-        return false;
+/*
+ * Pravi pocetni pool pre pokretanja gostiju. Gosti sa komandne linije su
+ * prva poznata potraznja, pa se pravi za svakog po VM, najvise N.
+ */
+static void warm_pool_init(size_t mem_size, int page_size, int num_guests){
+    uint64_t start = now_ns();
+    pthread_condattr_t attr;
+
+    warm.mem_size = mem_size;
+    warm.page_size = page_size;
+    warm.target = num_guests < opts.warm_pool ? num_guests : opts.warm_pool;
+    warm.demand = warm.target;
+    while (warm.count < warm.target) {
+        struct warm_vm *w = warm_create();
+        if (w == NULL) break;
+        warm.vms[warm.count++] = w;
+        warm.created++;
     }
-    if (*page_size != 2 && *page_size != 4) {
-        printf("Error: Invalid page size. Choose 2 or 4 KB.\n");
-        return false;
+    printf("Warm pool: %d VMs ready in %.3f ms\n", warm.count, (now_ns() - start) / 1e6);
+
+    // now_ns je CLOCK_MONOTONIC, pa i cekanje mora biti na tom satu
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&warm.wake, &attr);
+    pthread_condattr_destroy(&attr);
+    warm.running = pthread_create(&warm.thread, NULL, warm_main, NULL) == 0;
+}
+
+// Uzima gotovu VM, false ako je pool prazan (gost tada pravi svoju).
+static bool warm_take(struct vm *vm, int *page_size){
+    struct warm_vm *w = NULL;
+
+    pthread_mutex_lock(&warm.lock);
+    warm.takes++;
+    if (warm.count > 0) {
+        w = warm.vms[--warm.count];
+        warm.hits++;
+    } else {
+        warm.misses++;
     }
-    if (img == NULL) {
-        printf("Error: Guest image file not specified.\n");
+    pthread_cond_signal(&warm.wake);
+    pthread_mutex_unlock(&warm.lock);
+    if (w == NULL) {
         return false;
     }
 
-    // Print parsed values
-
-    // Your logic for handling the arguments goes here
-
+    // mutex se ne kopira, nova VM dobija svoj
+    *vm = w->vm;
+    pthread_mutex_init(&vm->console_lock, NULL);
+    *page_size = w->page_size;
+    free(w);
     return true;
 }
 
+static void warm_record(bool hit, uint64_t ns){
+    pthread_mutex_lock(&warm.lock);
+    lat_record(hit ? &warm.hit_lat : &warm.miss_lat, ns);
+    pthread_mutex_unlock(&warm.lock);
+}
 
+static void warm_pool_shutdown(void){
+    pthread_mutex_lock(&warm.lock);
+    warm.stop = true;
+    pthread_cond_signal(&warm.wake);
+    pthread_mutex_unlock(&warm.lock);
+    if (warm.running) {
+        pthread_join(warm.thread, NULL);
+    }
 
+    printf("Warm pool: %lu launches from the pool, %lu cold, %lu VMs created, %lu trimmed, %d left\n",
+           warm.hits, warm.misses, warm.created, warm.trimmed, warm.count);
+    lat_print("Launch latency (warm)", &warm.hit_lat);
+    lat_print("Launch latency (cold)", &warm.miss_lat);
+    while (warm.count > 0) {
+        warm_destroy(warm.vms[--warm.count]);
+    }
+}
 
-struct guest_args{
-    int mem_size;
-    int page_size;
-    char* file_name;
-    char** shared_files;
-    int num_shared;
-    int id;
-};
-sem_t mutex;
-
-typedef struct OpenFiles{
-    FILE* file;
-    char name[255];
-    bool copied;
-    struct OpenFiles* next;
-    char mode[3];
-}OpenFiles;
-
+/*
+ * Stanje jednog gosta. Bez --workers svaki vCPU gosta ima svoju nit koja ga
+ * vrti do kraja (vm_main, vcpu_main). Sa --workers N vCPU-i svih gostiju
+ * dele N radnih niti, pa se stanje koje je ranije bilo lokalno u vm_main
+ * cuva ovde, izmedju dva izvrsavanja.
+ */
+struct guest;
 
-char* generateNewName(char* name,char id){
-    char* ret = malloc(255);
-    strcpy(ret,name);
+struct guest_cpu {
+    struct guest *g;
+    int index;
+    struct vcpu *vcpu;
+    pthread_t thread;
+    bool has_thread; // vCPU ima svoju nit, guest_stop joj salje signal
 
-    bool flag = false;
-    char carry;
-    char temp;
-    int i=0;
-    while(ret[i]!='.')i++;
-    int index = i;
-    temp = ret[i];
+    // statistika izvrsioca
+    uint64_t queued_at;
+    uint64_t queue_ns; // ukupno vreme u redu spremnih
+    uint64_t run_ns; // ukupno vreme na radnoj niti
+    uint64_t slices;
+    uint64_t blocked;
+    struct lat_hist queue_lat;
+    struct guest_cpu *next;
 
-    while(ret[i+1]!='\0'){
-        carry = ret[i+1];
-        ret[i+1] = temp;
-        temp = carry;
-        i++;
-    }
-    ret[i+1] = temp;
-    ret[i+2] = '\0';
-    ret[index] = id;
+    uint64_t exit_at; // kada je KVM_RUN poslednji put izasao, 0 ako se ne meri
+    struct lat_hist exit_lat;
+};
 
-    return ret;
-    //strcat(name,&carry);
-}
-void* vm_main(void* args){
-    struct guest_args gargs = *((struct guest_args*)args);
+struct guest {
+    struct guest_args args;
     int id;
     struct vm vm;
-    struct kvm_sregs sregs;
-    struct kvm_regs regs;
-    int stop = 0;
-    int ret = 0;
-    FILE* img;
-    int data;
+    struct file_state fs;
+    struct io_worker io;
+    struct snapshot_header *snap;
+    int node;
+    size_t mem_size;
+    int page_size; // u bajtovima
+    int num_vcpus;
+    struct guest_cpu *cpus;
+    pthread_mutex_t lock; // stanje gosta koje menja vise vCPU-a (I/O red, running)
+    int running; // vCPU-i koji jos nisu stali
+    bool stopping; // jedan vCPU je naisao na gresku, staju svi
+    bool vm_created; // init_vm je pozvan, destroy_vm treba da pocisti
+    bool ready; // guest_setup je uspeo, gost moze da se izvrsava
+    bool snapshot_done;
+    bool first_exit;
+};
+
+static struct guest *guest_new(struct guest_args *args){
+    struct guest *g = calloc(1, sizeof(*g));
 
-    id = gargs.id;
-    char* file_name = gargs.file_name;
-    int page_size = gargs.page_size;
-    int MEM_SIZE = gargs.mem_size;
-    char** shared_files = gargs.shared_files;
-    int num_shared = gargs.num_shared;
-    int PAGE_SIZE;
-    switch(page_size){
+    g->args = *args;
+    g->id = args->id;
+    g->mem_size = args->mem_size;
+    switch(args->page_size){
+        case 1:
+            g->page_size = PAGE_1G;
+            break;
         case 2:
-            PAGE_SIZE = 0x200000;
+            g->page_size = 0x200000;
             break;
         case 4:
-            PAGE_SIZE = 0x1000;
+            g->page_size = 0x1000;
             break;
     }
+    g->node = opts.numa != NUMA_OFF ? numa_pick(g->id) : -1;
+    g->snapshot_done = opts.snapshot == NULL;
 
-    if (init_vm(&vm, MEM_SIZE)) {
-        printf("Failed to init the VM\n");
-        return NULL;
+    // snimak ima samo jedan vCPU
+    g->num_vcpus = args->snapshot ? 1 : opts.vcpus;
+    g->cpus = calloc(g->num_vcpus, sizeof(*g->cpus));
+    for (int i = 0; i < g->num_vcpus; i++) {
+        g->cpus[i].g = g;
+        g->cpus[i].index = i;
+        g->cpus[i].vcpu = &g->vm.vcpus[i];
     }
+    g->running = 1;
+    pthread_mutex_init(&g->lock, NULL);
 
-    if (ioctl(vm.vcpu_fd, KVM_GET_SREGS, &sregs) < 0) {
-        perror("KVM_GET_SREGS");
-        return NULL;
-    }
+    file_state_init(&g->fs, g->id, args->shared_files, args->num_shared);
+    g->io.vm = &g->vm;
+    g->io.fs = &g->fs;
+    g->vm.id = g->id;
+    return g;
+}
 
-    setup_long_mode(&vm, &sregs,MEM_SIZE,PAGE_SIZE);
+// Nit se vezuje za cvor gosta samo kada se cvor promeni.
+static void guest_bind(struct guest *g){
+    static __thread int bound_node = -1;
 
-    if (ioctl(vm.vcpu_fd, KVM_SET_SREGS, &sregs) < 0) {
-        perror("KVM_SET_SREGS");
-        return NULL;
+    if (g->node >= 0 && g->node != bound_node) {
+        numa_bind_thread(g->node);
+        bound_node = g->node;
     }
+}
 
-    memset(&regs, 0, sizeof(regs));
-    regs.rflags = 2;
-    regs.rip = 0;
-    // SP raste nadole
-    regs.rsp = MEM_SIZE;
-
+// Pravi VM i postavlja pocetno stanje (ili stanje iz snimka).
+static int guest_setup(struct guest *g){
+    struct kvm_regs regs;
+    char* file_name = g->args.file_name;
+    uint64_t start = now_ns();
+    bool from_pool = false;
 
+    // nit se vezuje pre init_vm, da bi i strukture KVM-a bile na cvoru
+    guest_bind(g);
 
-    if (ioctl(vm.vcpu_fd, KVM_SET_REGS, &regs) < 0) {
-        perror("KVM_SET_REGS");
-        return NULL;
+    // snimak nosi svoju velicinu memorije i stranice
+    if (g->args.snapshot) {
+        g->snap = malloc(sizeof(*g->snap));
+        if (read_snapshot_header(file_name, g->snap) < 0) {
+            return -1;
+        }
+        g->mem_size = g->snap->mem_size;
+        g->page_size = g->snap->page_size;
     }
 
-    //printf("%s\n",file_name);
+    g->vm_created = true;
+    if (opts.warm_pool && g->snap == NULL) {
+        from_pool = warm_take(&g->vm, &g->page_size);
+        g->vm.id = g->id;
+    }
+    if (!from_pool && vm_prepare(&g->vm, g->mem_size, &g->page_size, g->num_vcpus) < 0) {
+        return -1;
+    }
 
-    img = fopen(file_name, "r");
-    if (img == NULL) {
-        printf("Can not open binary file\n");
-        return NULL;
+    //mapiranje slike zamenjuje ceo pocetak memorije
+    if (g->snap == NULL && g->args.image == NULL) {
+        guest_printf(g->id, "Can not open binary file\n");
+        return -1;
+    }
+    if (g->snap == NULL && map_image(&g->vm, g->args.image, g->mem_size) < 0) {
+        return -1;
     }
 
-    char *p = vm.mem;
-    while(feof(img) == 0) {
-        int r = fread(p, 1, 1024, img);
-        p += r;
+    // svi vCPU-i krecu od rip = 0, svaki sa svojim stekom i indeksom u rdi
+    for (int i = 0; i < g->num_vcpus; i++) {
+        memset(&regs, 0, sizeof(regs));
+        regs.rflags = 2;
+        regs.rip = 0;
+        // SP raste nadole
+        regs.rsp = g->mem_size - (uint64_t)i * VCPU_STACK_SIZE;
+        regs.rdi = i;
+
+        if (ioctl(g->vm.vcpus[i].fd, KVM_SET_REGS, &regs) < 0) {
+            guest_perror(g->id, "KVM_SET_REGS");
+            return -1;
+        }
     }
-    fclose(img);
 
+    if (g->snap) {
+        if (restore_snapshot(&g->vm, file_name, g->snap) < 0) {
+            guest_printf(g->id, "Failed to restore snapshot %s\n", file_name);
+            return -1;
+        }
+    }
 
-    bool opening_file = false;
-    bool closing_file = false;
-    bool writing = false;
-    bool reading = false;
-    int read_size = 0;
+    if (opts.ksm) {
+        ksm_register(&g->vm);
+    }
+    if (g->node >= 0) {
+        numa_bind_memory(&g->vm, g->node);
+    }
 
-    bool getting_name = false;
-    bool getting_mode = false;
-    bool getting_size = false;
+    if (opts.warm_pool) {
+        warm_record(from_pool, now_ns() - start);
+    }
+    g->ready = true;
+    return 0;
+}
 
+static __thread struct kvm_run *running_run;
 
-    char mode[3];
-    char name[255];
-    char size[255];
-    int index =0;
-    FILE* current_file;
-    OpenFiles *file_list = NULL;
+// SIGUSR1 izbacuje vCPU ove niti iz KVM_RUN (kraj kvanta ili guest_stop).
+static void preempt_signal(int sig){
+    if (running_run) running_run->immediate_exit = 1;
+}
 
-    while(stop == 0) {
-        ret = ioctl(vm.vcpu_fd, KVM_RUN, 0);
-        if (ret == -1) {
-            printf("KVM_RUN failed\n");
-            return NULL;
+// Greska na jednom vCPU-u zaustavlja ceo gost, ostali izlaze iz KVM_RUN.
+static void guest_stop(struct guest *g){
+    __atomic_store_n(&g->stopping, true, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < g->vm.num_vcpus; i++) {
+        g->cpus[i].vcpu->run->immediate_exit = 1;
+        if (__atomic_load_n(&g->cpus[i].has_thread, __ATOMIC_ACQUIRE)) {
+            pthread_kill(g->cpus[i].thread, SIGUSR1);
         }
+    }
+}
+
+/*
+ * Obradjuje poslednji izlazak vCPU-a: 1 vCPU nastavlja, 0 vCPU je stao
+ * (HLT), -1 greska posle koje staje ceo gost.
+ */
+static int guest_handle_exit(struct guest_cpu *c){
+    struct guest *g = c->g;
+    struct kvm_run *run = c->vcpu->run;
+    int data;
 
-        switch (vm.kvm_run->exit_reason) {
-            case KVM_EXIT_IO:
-                if (vm.kvm_run->io.direction == KVM_EXIT_IO_OUT && vm.kvm_run->io.port == 0xE9) {
+    switch (run->exit_reason) {
+        case KVM_EXIT_IO: {
+            char *io_data = (char *)run + run->io.data_offset;
+            // kod string instrukcija (rep outsb/insb) count je broj elemenata velicine size
+            size_t io_bytes = (size_t)run->io.size * run->io.count;
 
-                    char *p = (char *)vm.kvm_run;
-                    printf("%c", *(p + vm.kvm_run->io.data_offset));
-                    if (*p == '\0') {
-                        usleep(100000);
+            if (run->io.direction == KVM_EXIT_IO_OUT && run->io.port == CONSOLE_RING_PORT) {
+                /*
+                 * doorbell za konzolni ring, podatak je adresa ringa
+                 */
+                if (run->io.size != 4) {
+                    guest_printf(g->id, "Console ring doorbell must be a 32-bit OUT\n");
+                    return -1;
+                }
+                for (uint32_t i = 0; i < run->io.count; i++) {
+                    uint32_t gpa = *(uint32_t *)(io_data + i * 4);
+                    if (drain_console_ring(&g->vm, gpa) < 0) {
+                        return -1;
                     }
                 }
-                else if (vm.kvm_run->io.direction == KVM_EXIT_IO_IN && vm.kvm_run->io.port == 0xE9) {
+            }
+            else if (run->io.direction == KVM_EXIT_IO_OUT && run->io.port == CONSOLE_PORT) {
 
-                    printf("input: \n");
+                vm_console_write(&g->vm, io_data, io_bytes);
+            }
+            else if (run->io.direction == KVM_EXIT_IO_IN && run->io.port == CONSOLE_PORT) {
+                /*
+                 * svaki element je jedan broj sa ulaza, upisan u sirini pristupa (inb/inw/inl)
+                 */
+                for (uint32_t i = 0; i < run->io.count; i++) {
+                    guest_printf(g->id, "input: \n");
                     scanf("%d", &data);
-                    char *data_in = (((char*)vm.kvm_run)+ vm.kvm_run->io.data_offset);
-                    (*data_in) = data;
-
+                    memcpy(io_data + i * run->io.size, &data, run->io.size);
                 }
-                else if (vm.kvm_run->io.direction == KVM_EXIT_IO_IN && vm.kvm_run->io.port == 0x278) {
-                    /*
-                     * citanje iz fajla
-                     */
-                    if (reading){
-
-                        //printf("reading character from file...\n");
-                        char *data_in = (((char*)vm.kvm_run)+ vm.kvm_run->io.data_offset);
-                        (*data_in) = fgetc(current_file);
-                        if (feof(current_file)){
-                            reading = false;
-                            char *data_in = (((char*)vm.kvm_run)+ vm.kvm_run->io.data_offset);
-                            (*data_in) = '\0';
-                        }
-
-
-                        if (ferror(current_file))printf("error...\n");
-                        //printf("%c\n",*data_in);
-                        read_size--;
-                        if (read_size == 0) reading = false;
-                    }
-                    else{
-                        char *data_in = (((char*)vm.kvm_run)+ vm.kvm_run->io.data_offset);
-                        (*data_in) = '\0';
-                    }
+            }
+            else if (run->io.direction == KVM_EXIT_IO_IN && run->io.port == FILE_PORT) {
+                /*
+                 * citanje iz fajla
+                 */
+                pthread_mutex_lock(&g->fs.lock);
+                for (size_t i = 0; i < io_bytes; i++) {
+                    io_data[i] = file_port_in(&g->fs, c->index);
                 }
-                else if (vm.kvm_run->io.direction == KVM_EXIT_IO_OUT && vm.kvm_run->io.port == 0x278) {
-                    /*
-                     * fopen, fclose, upis u fajl
-                     */
-                    char *p = (char *)vm.kvm_run;
-                    char input = *(p+vm.kvm_run->io.data_offset);//ovo je char koji je poslat
-                    /*
-                    if (input == '\0') {
-                        printf("\n");
+                pthread_mutex_unlock(&g->fs.lock);
+            }
+            else if (run->io.direction == KVM_EXIT_IO_OUT && run->io.port == IO_QUEUE_PORT) {
+                /*
+                 * registracija asinhronog reda
+                 */
+                if (run->io.size != 4) {
+                    guest_printf(g->id, "I/O queue registration must be a 32-bit OUT\n");
+                    return -1;
+                }
+                pthread_mutex_lock(&g->lock);
+                int ret = io_worker_start(&g->io, *(uint32_t *)io_data);
+                pthread_mutex_unlock(&g->lock);
+                if (ret < 0) {
+                    return -1;
+                }
+            }
+            else if (run->io.direction == KVM_EXIT_IO_OUT && run->io.port == IO_KICK_PORT) {
+                //stize ovde samo ako ioeventfd nije registrovan
+                io_worker_kick(&g->io);
+            }
+            else if (run->io.direction == KVM_EXIT_IO_OUT && run->io.port == FILE_PORT && run->io.size == 4) {
+                /*
+                 * opisni protokol, podatak je adresa struct file_request
+                 */
+                for (uint32_t i = 0; i < run->io.count; i++) {
+                    uint32_t gpa = *(uint32_t *)(io_data + i * 4);
+                    if (file_request(&g->vm, &g->fs, gpa) < 0) {
+                        return -1;
                     }
-                    printf("%c",input);
-                     */
-                    switch(input){
-                        case 0x01:
-                            //signal za pocetak fopen
-                            opening_file = true;
-                            getting_name = true;
-                            index = 0;
-                            break;
-                        case 0x02:
-                            //signal za pocetak fclose
-                            closing_file = true;
-                            getting_name = true;
-                            index = 0;
-                            break;
-                        case 0x03:
-                            //signal za pocetak read
-                            reading = true;
-                            getting_name = true;
-                            index = 0;
-                            break;
-                        case 0x04:
-                            //signal za pocetak write
-                            writing = true;
-                            getting_name = true;
-                            index = 0;
-                            break;
-                        default:
-                            //samo citamo charace test upisa u fajltere, na osnovu flegova odlucujemo sta je
-                            if (opening_file && getting_name){
-                                name[index] = input;
-                                index++;
-                                if (input == '\0'){
-                                    //imamo name, sada flegovi
-                                    getting_name = false;
-                                    getting_mode = true;
-                                    index = 0;
-                                }
-                            }
-                            else if (opening_file && getting_mode){
-                                mode[index] = input;
-                                index++;
-                                if (input == '\0'){
-                                    index = 0;
-                                    getting_mode = false;
-                                    opening_file = false;
-                                    //otvaramo fajl
-                                    current_file = fopen(name,mode);
-                                    if (!current_file){
-                                        printf("COULDNT OPEN FILE %s , in mode %s\n",name,mode);
-                                        return false;
-                                    }
-                                    else{
-                                        printf("opened file %s in mode %s\n",name,mode);
-                                        //dodaj u listu otvorenih
-                                        if (file_list == NULL){
-                                            file_list = malloc(sizeof(OpenFiles));
-                                            file_list->file = current_file;
-                                            strcpy(file_list->name,name);
-                                            file_list->next = NULL;
-                                            file_list->copied = false;
-                                            strcpy(file_list->mode,mode);
-                                            if (strcmp(mode,"w") == 0 || strcmp(mode,"w+") == 0 || strcmp(mode,"r+") == 0 ||
-                                                strcmp(mode,"a") == 0 ||strcmp(mode,"a+") == 0){
-                                                for (int i=0;i<num_shared;i++){
-                                                    if (strcmp(file_list->name,shared_files[i])==0 && !file_list->copied){
-                                                        //moramo da napravimo nov fajl
-                                                        printf("pravimo novi fajl\n");
-                                                        char t = (char)(id+48);
-                                                        char* h = file_list->name;
-                                                        fclose(file_list->file);
-                                                        file_list->copied = true;
-                                                        char* new_name = generateNewName(h,t);
-
-                                                        file_list->file = fopen(new_name,file_list->mode);
-                                                        if (!file_list->file){
-                                                            file_list->file = fopen(new_name,"w");
-                                                            fclose(file_list->file);
-                                                            file_list->file = fopen(new_name,file_list->mode);
-                                                        }
-                                                        printf("%s\n",new_name);
-                                                        break;
-                                                    }
-                                                }
-                                            }
-                                        }
-                                        else{
-                                            OpenFiles *temp = file_list;
-                                            while(temp->next)temp=temp->next;
-                                            temp->next = malloc(sizeof(OpenFiles));
-                                            temp = temp->next;
-                                            temp->file = current_file;
-                                            strcpy(temp->name,name);
-                                            temp->next = NULL;
-                                            temp->copied = false;
-                                            strcpy(temp->mode,mode);
-                                            if (strcmp(mode,"w") == 0 || strcmp(mode,"w+") == 0 || strcmp(mode,"r+") == 0 ||
-                                                strcmp(mode,"a") == 0 ||strcmp(mode,"a+") == 0){
-                                                for (int i=0;i<num_shared;i++){
-                                                    if (strcmp(temp->name,shared_files[i])==0 && !temp->copied){
-                                                        //moramo da napravimo nov fajl
-                                                        printf("pravimo novi fajl\n");
-                                                        char t = (char)(id+48);
-                                                        char* h = temp->name;
-                                                        fclose(temp->file);
-                                                        temp->copied = true;
-                                                        char* new_name = generateNewName(h,t);
-
-                                                        temp->file = fopen(new_name,temp->mode);
-                                                        if (!temp->file){
-                                                            temp->file = fopen(new_name,"w");
-                                                            fclose(temp->file);
-                                                            temp->file = fopen(new_name,temp->mode);
-                                                        }
-                                                        printf("%s\n",new_name);
-                                                        break;
-                                                    }
-                                                }
-                                            }
-                                        }
-                                        OpenFiles* temp = file_list;
-                                        printf("Open files: ");
-                                        while(temp){
-                                            printf("%s ",temp->name);
-                                            temp = temp->next;
-                                        }
-                                        printf("\n");
-                                    }
-                                }
-                            }
-                            else if (closing_file && getting_name){
-                                name[index] = input;
-                                index++;
-                                if (input == '\0'){
-                                    getting_name = false;
-                                    closing_file = false;
-                                    index = 0;
-                                    //nadji fajl koji zatvaramo u listi otvorenih
-                                    OpenFiles *temp = file_list;
-                                    OpenFiles *prev = NULL;
-                                    while(temp && strcmp(temp->name,name)!=0){
-                                        prev = temp;
-                                        temp=temp->next;
-                                    }
-                                    if (!temp){
-                                        printf("ERROR, attempted close on non-open file\n");
-                                        return false;
-                                    }
-                                    if (prev){
-                                        prev->next = temp->next;
-                                    }
-                                    fclose(temp->file);
-                                    printf("Successfully closed file %s\n",temp->name);
-                                    free(temp);
-                                }
-                            }
-                            else if (reading && getting_name){
-                                name[index] = input;
-                                index++;
-                                if (input == '\0'){
-                                    printf("reading from %s ... \n",name);
-                                    getting_name = false;
-                                    getting_size = true;
-                                    index = 0;
-                                    OpenFiles *temp = file_list;
-                                    while(temp && strcmp(temp->name,name)!=0)temp=temp->next;
-                                    if (!temp){
-                                        printf("ERROR, can't read from non-open file\n");
-                                        return false;
-                                    }
-                                    current_file = temp->file;
-                                }
-                            }
-                            else if (reading && getting_size){
-                                size[index] = input;
-                                index++;
-                                if (input == '\0'){
-                                    printf("reading %s characters from %s ... \n",size,name);
-                                    getting_size = false;
-                                    index = 0;
-                                    read_size = atoi(size);
-                                    fseek(current_file,0,0);
-                                }
-                            }
-                            else if (writing && getting_name){
-                                name[index] = input;
-                                index++;
-                                if (input == '\0'){
-                                    getting_name = false;
-                                    index = 0;
-                                }
-                            }
-                            else if (writing){
-                                if (input == '\0'){
-                                    writing = false;
-                                    break;
-                                }
-                                OpenFiles* temp = file_list;
-
-                                while(temp && strcmp(name,temp->name)!=0){
-                                    temp=temp->next;
-                                }
-                                if (!temp) {
-                                    printf("ERROR, cant write to non-open file\n");
-                                    return false;
-                                }
-                                //ako je fajl medju deljenim, mora da se napravi nov
-
-                                fwrite(&input,1,1,temp->file);
-
-                            }
-
-                            break;
+                }
+            }
+            else if (run->io.direction == KVM_EXIT_IO_OUT && run->io.port == FILE_PORT) {
+                /*
+                 * fopen, fclose, upis u fajl
+                 */
+                pthread_mutex_lock(&g->fs.lock);
+                for (size_t i = 0; i < io_bytes; i++) {
+                    if (file_port_out(&g->fs, c->index, io_data[i]) < 0) {
+                        pthread_mutex_unlock(&g->fs.lock);
+                        return -1;
                     }
-
                 }
+                pthread_mutex_unlock(&g->fs.lock);
+            }
+            return 1;
+        }
+        case KVM_EXIT_MMIO:
+            if (run->mmio.phys_addr >= MMIO_BASE && run->mmio.phys_addr < MMIO_BASE + MMIO_SIZE) {
+                if (mmio_access(&g->vm, &g->fs, run, c->index) < 0) {
+                    return -1;
+                }
+                return 1;
+            }
+            guest_printf(g->id, "MMIO outside of the device window at 0x%llx\n", run->mmio.phys_addr);
+            return -1;
+        case KVM_EXIT_HLT:
+            if (g->num_vcpus > 1) guest_printf(g->id, "KVM_EXIT_HLT on vCPU %d\n", c->index);
+            else guest_printf(g->id, "KVM_EXIT_HLT\n");
+            return 0;
+        case KVM_EXIT_INTERNAL_ERROR:
+            guest_printf(g->id, "Internal error: suberror = 0x%x\n", run->internal.suberror);
+            return -1;
+        case KVM_EXIT_SHUTDOWN:
+            guest_printf(g->id, "Shutdown\n");
+            return -1;
+        default:
+            guest_printf(g->id, "Exit reason: %d\n", run->exit_reason);
+            return 1;
+    }
+
+    return 1;
+}
+
+/*
+ * Izlasci kod kojih host moze da ceka (ulaz sa konzole, rad sa fajlovima).
+ * Izvrsilac ih ne obradjuje na radnoj niti nego ih predaje I/O nitima.
+ */
+static bool exit_may_block(struct guest_cpu *c){
+    struct kvm_run *run = c->vcpu->run;
+
+    if (run->exit_reason == KVM_EXIT_IO) {
+        return run->io.port == FILE_PORT ||
+               (run->io.port == CONSOLE_PORT && run->io.direction == KVM_EXIT_IO_IN);
+    }
+    if (run->exit_reason == KVM_EXIT_MMIO) {
+        uint64_t offset = run->mmio.phys_addr - MMIO_BASE;
+        return (!run->mmio.is_write && offset == MMIO_CONSOLE_IN) ||
+               (run->mmio.is_write && offset == MMIO_FILE_REQUEST);
+    }
+    return false;
+}
+
+#define GUEST_DONE 0 // vCPU je stao
+#define GUEST_PREEMPTED 1 // isteklo vreme, immediate_exit je prekinuo KVM_RUN
+#define GUEST_BLOCKED 2 // izlazak ceka obradu na I/O niti
+
+static int guest_run(struct guest_cpu *c, bool preemptible){
+    struct guest *g = c->g;
+    struct kvm_run *run = c->vcpu->run;
+
+    while (1) {
+        if (__atomic_load_n(&g->stopping, __ATOMIC_SEQ_CST)) {
+            return GUEST_DONE;
+        }
+        // snima se pre sledeceg ulaska, kada je prethodni izlazak obradjen
+        if (!g->snapshot_done && (opts.snapshot_at == SNAPSHOT_AT_EXIT ? g->first_exit : g->vm.snapshot_requested)) {
+            save_snapshot(&g->vm, g->page_size);
+            g->snapshot_done = true;
+            c->exit_at = 0;
+        }
+        g->first_exit = true;
+
+        if (c->exit_at) {
+            lat_record(&c->exit_lat, now_ns() - c->exit_at);
+            c->exit_at = 0;
+        }
+        if (ioctl(c->vcpu->fd, KVM_RUN, 0) == -1) {
+            if (errno == EINTR) {
+                run->immediate_exit = 0;
+                if (preemptible) return GUEST_PREEMPTED;
                 continue;
-            case KVM_EXIT_HLT:
-                printf("KVM_EXIT_HLT\n");
-                stop = 1;
-                break;
-            case KVM_EXIT_INTERNAL_ERROR:
-                printf("Internal error: suberror = 0x%x\n", vm.kvm_run->internal.suberror);
-                stop = 1;
-                break;
-            case KVM_EXIT_SHUTDOWN:
-                printf("Shutdown\n");
-                stop = 1;
-                break;
-            default:
-                printf("Exit reason: %d\n", vm.kvm_run->exit_reason);
+            }
+            guest_printf(g->id, "KVM_RUN failed\n");
+            guest_stop(g);
+            return GUEST_DONE;
+        }
+        c->exit_at = now_ns();
+        drain_coalesced(&g->vm);
+
+        if (preemptible && exit_may_block(c)) {
+            return GUEST_BLOCKED;
+        }
+        int r = guest_handle_exit(c);
+        if (r < 0) {
+            guest_stop(g);
+        }
+        if (r <= 0) {
+            return GUEST_DONE;
+        }
+    }
+}
+
+static void guest_teardown(struct guest *g){
+    io_worker_stop(&g->io);
+    file_state_release(&g->fs);
+    if (g->vm.free_reports) {
+        guest_printf(g->id, "Guest %d returned %lu KB to the host in %lu free page reports\n",
+               g->id, g->vm.reclaimed_bytes >> 10, g->vm.free_reports);
+    }
+    if (g->vm_created) {
+        if (opts.ksm) {
+            ksm_report(&g->vm);
+        }
+        if (g->node >= 0) {
+            numa_account(&g->vm, g->node);
+        }
+        destroy_vm(&g->vm);
+    }
+    free(g->snap);
+    console_close(g->id);
+
+    pthread_mutex_lock(&exit_latency_lock);
+    for (int i = 0; i < g->num_vcpus; i++) {
+        lat_merge(&exit_latency, &g->cpus[i].exit_lat);
+    }
+    pthread_mutex_unlock(&exit_latency_lock);
+    pthread_mutex_destroy(&g->lock);
+}
+
+static void guest_free(struct guest *g){
+    free(g->cpus);
+    free(g);
+}
+
+// Nit jednog vCPU-a, kada nema izvrsioca.
+static void *vcpu_main(void *arg){
+    struct guest_cpu *c = arg;
+
+    c->thread = pthread_self();
+    __atomic_store_n(&c->has_thread, true, __ATOMIC_RELEASE);
+    if (c->index > 0 && pin_active()) {
+        pin_thread(c->g->id * c->g->num_vcpus + c->index);
+    }
+
+    running_run = c->vcpu->run;
+    while (guest_run(c, false) != GUEST_DONE);
+    running_run = NULL;
+    return NULL;
+}
+
+void* vm_main(void* args){
+    struct guest *g = guest_new((struct guest_args*)args);
+    pthread_t threads[MAX_VCPUS];
+    int started = 1;
+
+    // pre guest_setup, da bi i vCPU i memorija nastali na tom procesoru
+    if (pin_active()) {
+        pin_thread(g->id * g->num_vcpus);
+    }
+    if (guest_setup(g) == 0) {
+        // vCPU 0 radi na ovoj niti, ostali dobijaju svoje
+        for (; started < g->num_vcpus; started++) {
+            if (pthread_create(&threads[started], NULL, vcpu_main, &g->cpus[started]) != 0) {
+                printf("Failed to start vCPU %d of guest %d\n", started, g->id);
+                guest_stop(g);
                 break;
+            }
+        }
+        vcpu_main(&g->cpus[0]);
+        for (int i = 1; i < started; i++) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+    guest_teardown(g);
+    guest_free(g);
+    return NULL;
+}
+
+/*
+ * Izvrsilac sa ogranicenim brojem radnih niti (--workers N). Posao je jedan
+ * vCPU: spremni vCPU-i cekaju u redu, radna nit uzima prvog i vrti ga
+ * najvise opts.quantum_ms. Tada tajmer salje SIGUSR1 bas toj niti,
+ * obradjivac postavlja immediate_exit, KVM_RUN izlazi sa EINTR i vCPU ide
+ * na kraj reda. Izlasci koji mogu da blokiraju idu u red blokiranih, koji
+ * prazne I/O niti, pa radna nit odmah uzima sledeci vCPU. U red prvo ulazi
+ * samo vCPU 0, ostali tek kada je VM napravljena. Gost se gasi kada stane
+ * poslednji vCPU.
+ */
+struct guest_queue {
+    struct guest_cpu *head;
+    struct guest_cpu *tail;
+    pthread_cond_t cond;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct guest_queue ready;
+    struct guest_queue blocked;
+    int remaining; // gosti koji jos nisu zavrsili
+    int finished;
+    uint64_t queue_ns;
+    uint64_t run_ns;
+    struct lat_hist queue_lat;
+} sched = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .ready = { .cond = PTHREAD_COND_INITIALIZER },
+    .blocked = { .cond = PTHREAD_COND_INITIALIZER },
+};
+
+static void sched_push(struct guest_queue *q, struct guest_cpu *c){
+    pthread_mutex_lock(&sched.lock);
+    c->queued_at = now_ns();
+    c->next = NULL;
+    if (q->tail) q->tail->next = c;
+    else q->head = c;
+    q->tail = c;
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&sched.lock);
+}
+
+// Ceka vCPU u redu, NULL kada su svi gosti zavrsili.
+static struct guest_cpu *sched_pop(struct guest_queue *q){
+    struct guest_cpu *c;
+
+    pthread_mutex_lock(&sched.lock);
+    while (q->head == NULL && sched.remaining > 0) {
+        pthread_cond_wait(&q->cond, &sched.lock);
+    }
+    c = q->head;
+    if (c) {
+        q->head = c->next;
+        if (q->head == NULL) q->tail = NULL;
+    }
+    pthread_mutex_unlock(&sched.lock);
+    return c;
+}
+
+// vCPU je stao, poslednji vCPU gasi gosta.
+static void sched_finish(struct guest_cpu *c){
+    struct guest *g = c->g;
+    uint64_t queue_ns = 0, run_ns = 0, slices = 0, blocked = 0;
+
+    pthread_mutex_lock(&g->lock);
+    bool last = --g->running == 0;
+    pthread_mutex_unlock(&g->lock);
+    if (!last) return;
+
+    for (int i = 0; i < g->num_vcpus; i++) {
+        queue_ns += g->cpus[i].queue_ns;
+        run_ns += g->cpus[i].run_ns;
+        slices += g->cpus[i].slices;
+        blocked += g->cpus[i].blocked;
+    }
+    guest_teardown(g);
+    guest_printf(g->id, "Guest %d: %.3f ms in queue, %.3f ms running in %lu slices, blocked %lu times\n",
+           g->id, queue_ns / 1e6, run_ns / 1e6, slices, blocked);
+
+    pthread_mutex_lock(&sched.lock);
+    sched.queue_ns += queue_ns;
+    sched.run_ns += run_ns;
+    for (int i = 0; i < g->num_vcpus; i++) {
+        lat_merge(&sched.queue_lat, &g->cpus[i].queue_lat);
+    }
+    sched.finished++;
+    sched.remaining--;
+    if (sched.remaining == 0) {
+        pthread_cond_broadcast(&sched.ready.cond);
+        pthread_cond_broadcast(&sched.blocked.cond);
+    }
+    pthread_mutex_unlock(&sched.lock);
+    guest_free(g);
+}
+
+static void *sched_worker(void *arg){
+    struct sigevent sev;
+    struct itimerspec quantum, off;
+    timer_t timer;
+    struct guest_cpu *c;
+
+    if (pin_active()) {
+        pin_thread((int)(intptr_t)arg);
+    }
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = SIGUSR1;
+    sev._sigev_un._tid = gettid();
+    if (timer_create(CLOCK_MONOTONIC, &sev, &timer) < 0) {
+        perror("timer_create");
+        return NULL;
+    }
+    memset(&off, 0, sizeof(off));
+    memset(&quantum, 0, sizeof(quantum));
+    quantum.it_value.tv_sec = opts.quantum_ms / 1000;
+    quantum.it_value.tv_nsec = (opts.quantum_ms % 1000) * 1000000L;
+
+    while ((c = sched_pop(&sched.ready)) != NULL) {
+        struct guest *g = c->g;
+        uint64_t start = now_ns();
+        c->queue_ns += start - c->queued_at;
+        lat_record(&c->queue_lat, start - c->queued_at);
+
+        if (!g->ready) {
+            if (guest_setup(g) < 0) {
+                sched_finish(c);
+                continue;
+            }
+            pthread_mutex_lock(&g->lock);
+            g->running = g->num_vcpus;
+            pthread_mutex_unlock(&g->lock);
+            for (int i = 1; i < g->num_vcpus; i++) {
+                sched_push(&sched.ready, &g->cpus[i]);
+            }
+        }
+        guest_bind(g);
+
+        running_run = c->vcpu->run;
+        timer_settime(timer, 0, &quantum, NULL);
+        int r = guest_run(c, true);
+        running_run = NULL;
+        timer_settime(timer, 0, &off, NULL);
+        c->vcpu->run->immediate_exit = 0;
+
+        c->run_ns += now_ns() - start;
+        c->slices++;
+        if (r == GUEST_PREEMPTED) {
+            sched_push(&sched.ready, c);
+        } else if (r == GUEST_BLOCKED) {
+            c->blocked++;
+            sched_push(&sched.blocked, c);
+        } else {
+            sched_finish(c);
+        }
+    }
+    timer_delete(timer);
+    return NULL;
+}
+
+// Obradjuje izlaske koji mogu da blokiraju, pa vraca vCPU u red spremnih.
+static void *sched_io(void *arg){
+    struct guest_cpu *c;
+
+    while ((c = sched_pop(&sched.blocked)) != NULL) {
+        int r = guest_handle_exit(c);
+        if (r < 0) {
+            guest_stop(c->g);
+        }
+        if (r <= 0) {
+            sched_finish(c);
+        } else {
+            sched_push(&sched.ready, c);
         }
+    }
+    return NULL;
+}
+
+static void run_executor(struct guest_args *args, int num_guests){
+    pthread_t *workers = malloc(opts.workers * sizeof(pthread_t));
+    pthread_t *io = malloc(opts.workers * sizeof(pthread_t));
+
+    sched.remaining = num_guests;
+    for (int i = 0; i < num_guests; i++) {
+        sched_push(&sched.ready, &guest_new(&args[i])->cpus[0]);
+    }
+    for (int i = 0; i < opts.workers; i++) {
+        pthread_create(&workers[i], NULL, sched_worker, (void *)(intptr_t)i);
+        pthread_create(&io[i], NULL, sched_io, NULL);
+    }
+    for (int i = 0; i < opts.workers; i++) {
+        pthread_join(workers[i], NULL);
+        pthread_join(io[i], NULL);
+    }
 
+    if (sched.finished) {
+        printf("Executor: %d guests on %d workers, average %.3f ms in queue, %.3f ms running\n",
+               sched.finished, opts.workers, sched.queue_ns / 1e6 / sched.finished,
+               sched.run_ns / 1e6 / sched.finished);
+        lat_print("Queue delay", &sched.queue_lat);
     }
+    free(workers);
+    free(io);
 }
 
 int main(int argc, char *argv[])
 {
     sem_init(&mutex,0,1);
 
-    int mem_size;// 2,4,8 MB
-    int page_size;//2KB ili 2MB
-    int MEM_SIZE;
+    size_t mem_size = 0;// u bajtovima
+    int page_size = 0;//4KB ili 2MB
     char** file_names;
-    int num_guests;
-    char** shared_files;
-    int num_shared;
+    int num_guests = 0;
+    char** shared_files = NULL;
+    int num_shared = 0;
 
 
 
@@ -753,23 +4550,61 @@ int main(int argc, char *argv[])
     }
     */
 
-    pthread_t* threads = malloc(num_guests*sizeof(pthread_t));
-    switch(mem_size){
-        case 2:
-            MEM_SIZE = 0x200000;
-            break;
-        case 4:
-            MEM_SIZE = 0x400000;
-            break;
-        case 8:
-            MEM_SIZE = 0x800000;
-            break;
-        default:
-            break;
+    if (host_init() < 0) {
+        return -1;
     }
+    if (opts.vcpus > host.max_vcpus) {
+        printf("Error: KVM supports at most %d vCPUs per VM.\n", host.max_vcpus);
+        return -1;
+    }
+
+    pthread_t* threads = malloc(num_guests*sizeof(pthread_t));
 
     struct guest_args* args = malloc(num_guests*sizeof(struct guest_args));
 
+    //svaka razlicita slika se cita samo jednom
+    struct image_template** images = calloc(num_guests, sizeof(struct image_template*));
+    int num_images = 0;
+    for (int i=0;i<num_guests;i++){
+        args[i].snapshot = is_snapshot(file_names[i]);
+        if (args[i].snapshot) continue;
+        args[i].image = find_image(images, num_images, file_names[i]);
+        if (args[i].image == NULL){
+            args[i].image = load_image(file_names[i]);
+            images[num_images++] = args[i].image;
+        }
+    }
+
+    if (opts.ksm) {
+        ksm_setup();
+    }
+    if (opts.numa != NUMA_OFF && numa_init() < 0) {
+        return -1;
+    }
+    if (opts.pool) {
+        mem_pool_init(mem_size, opts.pool);
+    }
+    // glavna nit pravi konzolu i niti gostiju, one nasledjuju procesore za pomocne niti
+    if (pin_active()) {
+        if (pin_init() < 0) return -1;
+        pin_helper();
+    }
+    if (opts.warm_pool) {
+        int page_bytes = page_size == 1 ? PAGE_1G : page_size == 2 ? 0x200000 : 0x1000;
+        warm_pool_init(mem_size, page_bytes, num_guests);
+    }
+
+    // SIGUSR1 prekida KVM_RUN (kvant izvrsioca, guest_stop), bez SA_RESTART da bi KVM_RUN izasao sa EINTR
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = preempt_signal;
+    sigaction(SIGUSR1, &sa, NULL);
+
+    if (console_init(num_guests) < 0){
+        printf("Failed to init the console\n");
+        return -1;
+    }
+
     for (int i=0;i<num_guests;i++){
         /*
          * za svaki file u file_names treba da se napravi nit
@@ -777,16 +4612,47 @@ int main(int argc, char *argv[])
         args[i].id = i;
         args[i].file_name = file_names[i];
         args[i].page_size = page_size;
-        args[i].mem_size = MEM_SIZE;
+        args[i].mem_size = mem_size;
         args[i].shared_files = shared_files;
         args[i].num_shared = num_shared;
-        pthread_create(&threads[i],NULL,vm_main,(void*) (&args[i]));
+        if (opts.workers == 0) {
+            pthread_create(&threads[i],NULL,vm_main,(void*) (&args[i]));
+        }
     }
 
-    for (int i=0;i<num_guests;i++){
-        pthread_join(threads[i],NULL);
+    if (opts.workers > 0) {
+        run_executor(args, num_guests);
+    }
+    else {
+        for (int i=0;i<num_guests;i++){
+            pthread_join(threads[i],NULL);
+        }
+    }
+    console_shutdown();
+    if (opts.warm_pool) {
+        warm_pool_shutdown();
+    }
+    // sa oznakom politike, da bi se uporedili repovi sa i bez vezivanja
+    char lat_name[96];
+    snprintf(lat_name, sizeof(lat_name), "Exit latency (%s%s)", pin_names[opts.pin],
+             CPU_COUNT(&opts.housekeeping) > 0 ? ", housekeeping CPUs excluded" : "");
+    lat_print(lat_name, &exit_latency);
+    if (opts.ksm) {
+        ksm_summary();
+    }
+    if (opts.numa != NUMA_OFF) {
+        numa_report();
+    }
+    if (opts.pool) {
+        mem_pool_report();
+    }
+    for (int i=0;i<num_images;i++){
+        if (images[i]) free_image(images[i]);
     }
+    free(images);
     free(threads);
     free(args);
+    free(host.cpuid);
+    close(host.kvm_fd);
 
 }